@@ -0,0 +1,389 @@
+/**
+ * c_defer and c_scope_guard
+ * benchmarks
+ * by: cloudsong @ 2024
+ * License: MIT
+ *
+ * usage: ./bench1 [name]   -- run all benchmarks, or the one named @name
+ */
+
+#define ENABLE_SCOPE_TASKS
+#define ENABLE_DEFER_REGISTRY
+#define ENABLE_SCOPE_FILE
+
+#include "c_defer.h"
+#include "c_scopeguard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// -----------------------------------------------------------------------------
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define bench_report(name, ops, sec) \
+    printf("%-32s %10.2f ns/op  (%ld ops, %.3f s)\n", name, (sec) * 1e9 / (ops), (long)(ops), sec)
+
+static int nthreads() {
+    const char* s = getenv("BENCH_THREADS");
+    return s ? atoi(s) : 4;
+}
+
+/// run @fn on @n threads, return wall time
+static double run_threads(int n, void* (*fn)(void*), void* arg) {
+    pthread_t tids[64];
+    int i;
+    double t0 = now_sec();
+    for (i = 0; i < n && i < 64; i ++) {
+        pthread_create(&tids[i], NULL, fn, arg);
+    }
+    for (i = 0; i < n && i < 64; i ++) {
+        pthread_join(tids[i], NULL);
+    }
+    return now_sec() - t0;
+}
+
+// ---------------------------[ defer_unref ]-----------------------------------
+
+#define UNREF_ITERS     200000
+#define UNREF_PER_SCOPE 8
+
+typedef struct _hot_obj {
+    long refs;
+    long destroyed;
+} hot_obj_t;
+
+static void hot_obj_destroy(hot_obj_t* o) {
+    o->destroyed ++;
+}
+
+static void hot_obj_unref(hot_obj_t* o) {
+    if (__atomic_sub_fetch(&o->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        hot_obj_destroy(o);
+    }
+}
+
+static hot_obj_t g_hot_obj;
+
+/// one scope holds UNREF_PER_SCOPE refs of the shared object
+static void* unref_defer1_worker(void* arg) {
+    hot_obj_t* o = &g_hot_obj;
+    int i, k;
+    (void)arg;
+    for (i = 0; i < UNREF_ITERS; i ++) {
+        defer_init(1024, NULL);
+        __atomic_add_fetch(&o->refs, UNREF_PER_SCOPE, __ATOMIC_RELAXED);
+        for (k = 0; k < UNREF_PER_SCOPE; k ++) {
+            defer1(o, hot_obj_unref(o));
+        }
+    }
+    return NULL;
+}
+
+static void* unref_grouped_worker(void* arg) {
+    hot_obj_t* o = &g_hot_obj;
+    int i, k;
+    (void)arg;
+    for (i = 0; i < UNREF_ITERS; i ++) {
+        defer_init(1024, NULL);
+        __atomic_add_fetch(&o->refs, UNREF_PER_SCOPE, __ATOMIC_RELAXED);
+        for (k = 0; k < UNREF_PER_SCOPE; k ++) {
+            defer_unref(o, refs, hot_obj_destroy);
+        }
+    }
+    return NULL;
+}
+
+static void bench_unref() {
+    int  n = nthreads();
+    long ops = (long)n * UNREF_ITERS * UNREF_PER_SCOPE;
+    double t;
+
+    g_hot_obj.refs = 1;
+    t = run_threads(n, unref_defer1_worker, NULL);
+    bench_report("unref: defer1(obj_unref)", ops, t);
+
+    g_hot_obj.refs = 1;
+    t = run_threads(n, unref_grouped_worker, NULL);
+    bench_report("unref: defer_unref", ops, t);
+
+    if (g_hot_obj.refs != 1 || g_hot_obj.destroyed) {
+        printf("*** unref: refs=%ld destroyed=%ld\n", g_hot_obj.refs, g_hot_obj.destroyed);
+    }
+}
+
+// ---------------------------[ icache: hot/cold ]------------------------------
+// many small functions with error-path cleanups, called round-robin.
+// build with `-DENABLE_DEFER_COLD_CLEANUP` (bench1_cold) to move cleanup bodies out of hot text.
+
+#define ICACHE_CALLS 4000000
+
+static volatile int g_icache_fail = 0;
+
+#define ICACHE_FN(n) \
+static __attribute__((noinline)) long icache_fn_##n(long x) { \
+    defer_init(256, NULL); \
+    long acc = x * 0x##n + 7; \
+    if (__builtin_expect(g_icache_fail, 0)) { \
+        defer2(x, acc, { \
+            fprintf(stderr, "fn %s: failed x=%ld acc=%ld\\n", #n, x, acc); \
+            fprintf(stderr, "fn %s: rollback step 1 of %ld\\n", #n, acc ^ x); \
+            fprintf(stderr, "fn %s: rollback step 2 of %ld\\n", #n, acc + x); \
+            fprintf(stderr, "fn %s: rollback step 3 of %ld\\n", #n, acc - x); \
+            fflush(stderr); \
+        }); \
+    } \
+    acc ^= acc >> 7; \
+    acc += x << 3; \
+    return acc; \
+}
+
+#define ICACHE_R16(m, p) \
+    m(p##0) m(p##1) m(p##2) m(p##3) m(p##4) m(p##5) m(p##6) m(p##7) \
+    m(p##8) m(p##9) m(p##a) m(p##b) m(p##c) m(p##d) m(p##e) m(p##f)
+
+#define ICACHE_R256(m) \
+    ICACHE_R16(m, 0) ICACHE_R16(m, 1) ICACHE_R16(m, 2) ICACHE_R16(m, 3) \
+    ICACHE_R16(m, 4) ICACHE_R16(m, 5) ICACHE_R16(m, 6) ICACHE_R16(m, 7) \
+    ICACHE_R16(m, 8) ICACHE_R16(m, 9) ICACHE_R16(m, a) ICACHE_R16(m, b) \
+    ICACHE_R16(m, c) ICACHE_R16(m, d) ICACHE_R16(m, e) ICACHE_R16(m, f)
+
+ICACHE_R256(ICACHE_FN)
+
+#define ICACHE_PTR(n) icache_fn_##n,
+
+static long (* const g_icache_fns[])(long) = {
+    ICACHE_R256(ICACHE_PTR)
+};
+
+static void bench_icache() {
+    long i, acc = 0;
+    double t0 = now_sec();
+    for (i = 0; i < ICACHE_CALLS; i ++) {
+        acc += g_icache_fns[i & 255](i);
+    }
+#ifdef ENABLE_DEFER_COLD_CLEANUP
+    t0 = now_sec() - t0;
+    bench_report("icache: cold cleanup", ICACHE_CALLS, t0);
+#else
+    t0 = now_sec() - t0;
+    bench_report("icache: inline cleanup", ICACHE_CALLS, t0);
+#endif
+    if (acc == 42) {
+        printf("\n");
+    }
+}
+
+// ---------------------------[ scope_tasks: parallel sum ]---------------------
+
+#define PSUM_COUNT  (8 * 1024 * 1024)
+#define PSUM_ROUNDS 10
+#define PSUM_PARTS  64
+
+static void psum_part(const int* arr, long lo, long hi, long* out) {
+    long sum = 0, i;
+    for (i = lo; i < hi; i ++) {
+        sum += arr[i];
+    }
+    *out = sum;
+}
+
+static void bench_parallel_sum() {
+    int*  arr = (int*)malloc(sizeof(int) * PSUM_COUNT);
+    long  parts[PSUM_PARTS];
+    long  i, r, serial = 0, parallel = 0;
+    long  step = PSUM_COUNT / PSUM_PARTS;
+    long  ops = (long)PSUM_COUNT * PSUM_ROUNDS;
+    double t0;
+    scope_pool_t* pool = scope_pool_create(nthreads());
+
+    for (i = 0; i < PSUM_COUNT; i ++) {
+        arr[i] = (int)(i & 1023);
+    }
+
+    t0 = now_sec();
+    for (r = 0; r < PSUM_ROUNDS; r ++) {
+        psum_part(arr, 0, PSUM_COUNT, &parts[0]);
+        serial += parts[0];
+    }
+    t0 = now_sec() - t0;
+    bench_report("parallel sum: serial", ops, t0);
+
+    t0 = now_sec();
+    for (r = 0; r < PSUM_ROUNDS; r ++) {
+        scope_tasks(pool) {
+            for (i = 0; i < PSUM_PARTS; i ++) {
+                scope_spawn(psum_part, (const int*)arr, i * step, (i + 1) * step, &parts[i]);
+            }
+        }
+        for (i = 0; i < PSUM_PARTS; i ++) {
+            parallel += parts[i];
+        }
+    }
+    t0 = now_sec() - t0;
+    bench_report("parallel sum: scope_tasks", ops, t0);
+
+    if (serial != parallel) {
+        printf("*** parallel sum: %ld != %ld\n", parallel, serial);
+    }
+    scope_pool_destroy(pool);
+    free(arr);
+}
+
+// ---------------------------[ fast exit ]-------------------------------------
+// a child process registers many memory-only `free` closures, then exits.
+// time is measured from fork to reap, so it includes registration.
+
+#define FAST_EXIT_CLOSURES 1000000
+
+static double fast_exit_child(int fast) {
+    double t0 = now_sec();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int i;
+        for (i = 0; i < FAST_EXIT_CLOSURES; i ++) {
+            char* p = (char*)malloc(64 + (i & 255));
+            defer_process_mem1(p, free(p));
+        }
+        defer_set_fast_exit(fast);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    return now_sec() - t0;
+}
+
+static void bench_fast_exit() {
+    double t;
+    fflush(stdout);
+    t = fast_exit_child(0);
+    bench_report("exit: run memory-only closures", FAST_EXIT_CLOSURES, t);
+    fflush(stdout);
+    t = fast_exit_child(1);
+    bench_report("exit: fast-exit mode", FAST_EXIT_CLOSURES, t);
+}
+
+// ---------------------------[ scope_mmap_file: streaming ]--------------------
+// sum all bytes of a file: read() into malloc'd buffer vs scoped mmap
+
+#define STREAM_FILE_SIZE (64L * 1024 * 1024)
+#define STREAM_ROUNDS    5
+
+static unsigned long stream_sum(const unsigned char* p, size_t n) {
+    unsigned long sum = 0;
+    size_t i;
+    for (i = 0; i < n; i ++) {
+        sum += p[i];
+    }
+    return sum;
+}
+
+static unsigned long stream_read(const char* path) {
+    unsigned long sum = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    scope_exit1(fd, close(fd));
+
+    struct stat st;
+    fstat(fd, &st);
+    unsigned char* buf = (unsigned char*)malloc(st.st_size);
+    scope_exit1(buf, free(buf));
+
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        ssize_t n = read(fd, buf + got, st.st_size - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    sum = stream_sum(buf, got);
+    return sum;
+}
+
+static unsigned long stream_mmap(const char* path) {
+    scope_mmap_view_t view;
+    scope_mmap_file_ex(path, &view, SCOPE_MMAP_POPULATE | SCOPE_MMAP_SEQUENTIAL);
+    if (view.error) {
+        return 0;
+    }
+    return stream_sum((const unsigned char*)view.data, view.size);
+}
+
+static void bench_stream() {
+    char path[] = "/tmp/c_defer_bench_XXXXXX";
+    int  fd = mkstemp(path);
+    long i, r;
+    unsigned long s1 = 0, s2 = 0;
+    double t0;
+    if (fd < 0) {
+        return;
+    }
+    const char* tmp_path = path; // blocks cannot capture arrays
+    scope_exit1(tmp_path, unlink(tmp_path));
+    {
+        char* chunk = (char*)malloc(1 << 20);
+        scope_exit1(chunk, free(chunk));
+        for (i = 0; i < (1 << 20); i ++) {
+            chunk[i] = (char)(i * 31);
+        }
+        for (i = 0; i < STREAM_FILE_SIZE / (1 << 20); i ++) {
+            if (write(fd, chunk, 1 << 20) != (1 << 20)) {
+                close(fd);
+                return;
+            }
+        }
+        close(fd);
+    }
+
+    t0 = now_sec();
+    for (r = 0; r < STREAM_ROUNDS; r ++) {
+        s1 += stream_read(path);
+    }
+    t0 = now_sec() - t0;
+    bench_report("stream: read() into malloc", STREAM_FILE_SIZE * STREAM_ROUNDS, t0);
+
+    t0 = now_sec();
+    for (r = 0; r < STREAM_ROUNDS; r ++) {
+        s2 += stream_mmap(path);
+    }
+    t0 = now_sec() - t0;
+    bench_report("stream: scope_mmap_file", STREAM_FILE_SIZE * STREAM_ROUNDS, t0);
+
+    if (s1 != s2) {
+        printf("*** stream: %lu != %lu\n", s1, s2);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+static const struct {
+    const char* name;
+    void (*fn)();
+} g_benches[] = {
+    { "unref", bench_unref },
+    { "icache", bench_icache },
+    { "parallel_sum", bench_parallel_sum },
+    { "fast_exit", bench_fast_exit },
+    { "stream", bench_stream },
+};
+
+int main(int argc, char* argv[]) {
+    size_t i;
+    for (i = 0; i < sizeof(g_benches) / sizeof(g_benches[0]); i ++) {
+        if (argc < 2 || strcmp(argv[1], g_benches[i].name) == 0) {
+            g_benches[i].fn();
+        }
+    }
+    return 0;
+}
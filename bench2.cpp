@@ -0,0 +1,162 @@
+/**
+ * c_defer and c_scope_guard
+ * benchmarks of C++ version, compared with hand-written RAII
+ * by: cloudsong @ 2024
+ * License: MIT
+ *
+ * usage: ./bench2 [name]   -- run all benchmarks, or the one named @name
+ */
+
+#include "c_defer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// -----------------------------------------------------------------------------
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define bench_report(name, ops, sec) \
+    printf("%-32s %10.2f ns/op  (%ld ops, %.3f s)\n", name, (sec) * 1e9 / (ops), (long)(ops), sec)
+
+#define ITERS 10000000
+
+static volatile long g_sink;
+
+/// keep cleanup bodies observable, but cheap
+static void __attribute__((noinline)) release_res(long v) {
+    g_sink += v;
+}
+
+// ------------------------------[ raii ]---------------------------------------
+
+struct res_guard {
+    long v;
+    explicit res_guard(long v): v(v) {}
+    ~res_guard() { release_res(v); }
+    res_guard(const res_guard&) = delete;
+};
+
+static void __attribute__((noinline)) raii_scope(long i) {
+    res_guard a(i);
+    res_guard b(i + 1);
+    res_guard c(i + 2);
+    g_sink ^= i;
+}
+
+static void __attribute__((noinline)) scope_exit_scope(long i) {
+    scope_exit1_ex(i, release_res(scope_arg(0)));
+    scope_exit1_ex(i + 1, release_res(scope_arg(0)));
+    scope_exit1_ex(i + 2, release_res(scope_arg(0)));
+    g_sink ^= i;
+}
+
+static void __attribute__((noinline)) defer_scope(long i) {
+    defer_init(128, nullptr);
+    defer1_ex(i, release_res(defer_arg(0)));
+    defer1_ex(i + 1, release_res(defer_arg(0)));
+    defer1_ex(i + 2, release_res(defer_arg(0)));
+    g_sink ^= i;
+}
+
+static void bench_raii() {
+    long i;
+    double t0, sec;
+
+    t0 = now_sec();
+    for (i = 0; i < ITERS; i ++) {
+        raii_scope(i);
+    }
+    sec = now_sec() - t0;
+    bench_report("raii: hand-written", ITERS, sec);
+
+    t0 = now_sec();
+    for (i = 0; i < ITERS; i ++) {
+        scope_exit_scope(i);
+    }
+    sec = now_sec() - t0;
+    bench_report("raii: scope_exit", ITERS, sec);
+
+    t0 = now_sec();
+    for (i = 0; i < ITERS; i ++) {
+        defer_scope(i);
+    }
+    sec = now_sec() - t0;
+    bench_report("raii: defer", ITERS, sec);
+}
+
+// ---------------------------[ conditional ]-----------------------------------
+
+/// cleanups registered only on some paths: RAII needs an engaged flag,
+/// defer only registers what was acquired
+struct opt_guard {
+    long v;
+    bool engaged = false;
+    ~opt_guard() { if (engaged) release_res(v); }
+};
+
+static void __attribute__((noinline)) raii_cond_scope(long i) {
+    opt_guard g[4];
+    for (int k = 0; k < 4; k ++) {
+        if ((i >> k) & 1) {
+            g[k].v = i + k;
+            g[k].engaged = true;
+        }
+    }
+    g_sink ^= i;
+}
+
+static void __attribute__((noinline)) defer_cond_scope(long i) {
+    defer_init(256, nullptr);
+    for (int k = 0; k < 4; k ++) {
+        if ((i >> k) & 1) {
+            defer1_ex(i + k, release_res(defer_arg(0)));
+        }
+    }
+    g_sink ^= i;
+}
+
+static void bench_cond() {
+    long i;
+    double t0, sec;
+
+    t0 = now_sec();
+    for (i = 0; i < ITERS; i ++) {
+        raii_cond_scope(i);
+    }
+    sec = now_sec() - t0;
+    bench_report("cond: hand-written", ITERS, sec);
+
+    t0 = now_sec();
+    for (i = 0; i < ITERS; i ++) {
+        defer_cond_scope(i);
+    }
+    sec = now_sec() - t0;
+    bench_report("cond: defer", ITERS, sec);
+}
+
+// -----------------------------------------------------------------------------
+
+static const struct {
+    const char* name;
+    void (*fn)();
+} g_benches[] = {
+    { "raii", bench_raii },
+    { "cond", bench_cond },
+};
+
+int main(int argc, char* argv[]) {
+    size_t i;
+    for (i = 0; i < sizeof(g_benches) / sizeof(g_benches[0]); i ++) {
+        if (argc < 2 || strcmp(argv[1], g_benches[i].name) == 0) {
+            g_benches[i].fn();
+        }
+    }
+    return 0;
+}
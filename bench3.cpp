@@ -0,0 +1,196 @@
+/**
+ * c_defer and c_scope_guard
+ * benchmark of defer scopes in coroutine frames, on a local echo loop (socketpair)
+ * compared with per-operation heap-allocated cleanup lists
+ * by: cloudsong @ 2024
+ * License: MIT
+ *
+ * usage: ./bench3
+ */
+
+#define ENABLE_DEFER_COROUTINE
+
+#include "c_defer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <new>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// -----------------------------------------------------------------------------
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define bench_report(name, ops, sec) \
+    printf("%-32s %10.2f ns/op  (%ld ops, %.3f s)\n", name, (sec) * 1e9 / (ops), (long)(ops), sec)
+
+/// count heap allocations
+static long g_news;
+
+void* operator new(std::size_t size) {
+    g_news ++;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    free(p);
+}
+
+#define ITERS   200000
+#define MSG_LEN 64
+
+// -----------------------------------------------------------------------------
+
+static std::coroutine_handle<> g_waiting;
+
+/// suspend until @fd is readable, the loop resumes it
+struct readable {
+    int fd;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { g_waiting = h; }
+    void await_resume() const noexcept {}
+};
+
+template <class Promise>
+struct basic_task {
+    using promise_type = Promise;
+    std::coroutine_handle<Promise> h;
+    ~basic_task() {
+        if (h) {
+            h.destroy();
+        }
+    }
+};
+
+template <class Base>
+struct basic_promise: Base {
+    basic_task<basic_promise> get_return_object() noexcept {
+        return { std::coroutine_handle<basic_promise>::from_promise(*this) };
+    }
+    std::suspend_never  initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { abort(); }
+};
+
+struct no_base {};
+
+using co_defer_task = basic_task<basic_promise<c_defer::coro_defer<256>>>;
+using heap_task     = basic_task<basic_promise<no_base>>;
+
+// ---------------------------[ echo operations ]-------------------------------
+
+static void release_stat(long* stat) {
+    (*stat) ++;
+}
+
+static void release_fd(long* stat, int fd) {
+    (*stat) += (fd >= 0);
+}
+
+/// cleanups and buffer in the coroutine frame
+static co_defer_task co_defer_echo(int fd, long* stat) {
+    co_defer_init();
+
+    char* buf = (char*)defer_alloc(MSG_LEN, 0);
+    defer1(stat, release_stat(stat));
+    defer2(stat, fd, release_fd(stat, fd));
+
+    co_await readable{ fd };
+    ssize_t n = read(fd, buf, MSG_LEN);
+    if (n > 0 && write(fd, buf, n) != n) {
+        abort();
+    }
+}
+
+/// cleanup list allocated for each operation
+struct heap_cleanups {
+    std::vector<std::function<void()>>* list = new std::vector<std::function<void()>>();
+    ~heap_cleanups() {
+        for (auto it = list->rbegin(); it != list->rend(); ++ it) {
+            (*it)();
+        }
+        delete list;
+    }
+};
+
+static heap_task heap_echo(int fd, long* stat) {
+    heap_cleanups cleanups;
+
+    char* buf = new char[MSG_LEN];
+    cleanups.list->push_back([buf] { delete[] buf; });
+    cleanups.list->push_back([stat] { release_stat(stat); });
+    cleanups.list->push_back([stat, fd] { release_fd(stat, fd); });
+
+    co_await readable{ fd };
+    ssize_t n = read(fd, buf, MSG_LEN);
+    if (n > 0 && write(fd, buf, n) != n) {
+        abort();
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+/// run @op for each message: client writes, operation is resumed when readable, echoes, and is destroyed
+template <class Task>
+static void echo_loop(const char* name, Task (*op)(int, long*)) {
+    int fds[2];
+    char msg[MSG_LEN], reply[MSG_LEN];
+    long stat = 0;
+    long i;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return;
+    }
+    memset(msg, 'e', sizeof(msg));
+
+    long news = g_news;
+    double t0 = now_sec();
+    for (i = 0; i < ITERS; i ++) {
+        Task t = op(fds[1], &stat);
+        if (write(fds[0], msg, MSG_LEN) != MSG_LEN) {
+            abort();
+        }
+        struct pollfd p = { fds[1], POLLIN, 0 };
+        poll(&p, 1, -1);
+        g_waiting.resume();
+        if (read(fds[0], reply, MSG_LEN) != MSG_LEN) {
+            abort();
+        }
+    }
+    double sec = now_sec() - t0;
+    bench_report(name, ITERS, sec);
+    printf("%-32s %10.2f allocs/op, cleanups called: %ld\n", "", (double)(g_news - news) / ITERS, stat);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main() {
+    int round;
+    // alternate, the first round warms up
+    for (round = 0; round < 2; round ++) {
+        echo_loop("echo: co_defer (frame arena)", co_defer_echo);
+        echo_loop("echo: heap cleanup list", heap_echo);
+    }
+
+    return 0;
+}
@@ -22,11 +22,89 @@
     #include <signal.h> // to raise SEGV if closure-stack is low!
 #endif
 
+/// enable hot/cold splitting
+/// bodies of defer closures and slow path of closure allocation are emitted as `cold` (.text.unlikely),
+/// keep them out of hot text. use `defer_hot()` for cleanups that run on every call.
+#if 0
+    #define ENABLE_DEFER_COLD_CLEANUP
+#endif
+
+#ifdef ENABLE_DEFER_COLD_CLEANUP
+    #define __DEFER_COLD_ATTR __attribute__((cold, noinline))
+#else
+    #define __DEFER_COLD_ATTR
+#endif
+
+/// closure backend, selected by compiler:
+/// gcc: nested functions; clang: blocks, build with `-fblocks` and link with `-lBlocksRuntime`.
+/// !!! with blocks, outer local vars used in closure body are captured by value when registering,
+/// and are read-only in it: this differs from gcc. declare them with `defer_byref` to access them
+/// by-ref as gcc does, `DEFER_BYREF_CAPTURE` tells which semantics is used.
+#if defined(__clang__) && !defined(__cplusplus)
+    #ifndef __BLOCKS__
+        #error "c_defer.h needs blocks on clang, build with -fblocks"
+    #endif
+    #define __DEFER_BLOCKS
+#endif
+
+/// closures that outlive the frame registering them (`defer_transfer`, `defer_process*`, `defer_thread*`)
+/// are called after that frame is gone. gcc calls nested functions through trampolines on the stack
+/// of that frame at -O0, so these APIs are rejected at compile time without optimization.
+/// blocks (clang) and lambdas (c_defer.hpp) have no such limit.
+#if defined(__OPTIMIZE__) || defined(__DEFER_BLOCKS) || defined(__cplusplus)
+    #define DEFER_OUTLIVE_OK 1
+#else
+    #define DEFER_OUTLIVE_OK 0
+#endif
+
+#ifdef __cplusplus
+    #define __defer_outlive_check(api)
+#else
+    #define __defer_outlive_check(api) \
+        _Static_assert(DEFER_OUTLIVE_OK, api " needs -O1/-Og or higher with gcc: " \
+            "nested functions are called through trampolines on the stack at -O0")
+#endif
+
+#ifndef defer_byref
+    #if defined(__BLOCKS__)
+        #define defer_byref __block
+        #define DEFER_BYREF_CAPTURE 0 // outer vars are captured by value, unless declared `defer_byref`
+    #else
+        #define defer_byref
+        #define DEFER_BYREF_CAPTURE 1 // outer vars are accessed by-ref
+    #endif
+#endif
+
+#include <limits.h>
+#include <pthread.h> // thread-exit release of per-thread chunk cache
+#include <stdint.h>
+#include <stdlib.h> // malloc/free for spilled `defer_alloc` chunks
+#include <string.h> // memcpy for `defer_transfer`
+
+/// size of each spilled chunk used by `defer_alloc`, when builtin buffer is full
+/// bigger requests get a chunk of their own
+#ifndef DEFER_ALLOC_CHUNK_SIZE
+    #define DEFER_ALLOC_CHUNK_SIZE (16 * 1024)
+#endif
+
+/// max count of free chunks cached per-thread, for reusing by next scopes
+#ifndef DEFER_ALLOC_POOL_MAX
+    #define DEFER_ALLOC_POOL_MAX 8
+#endif
+
+/// how many recent `defer_unref` closures are searched for the same object,
+/// keep registration O(1)
+#ifndef DEFER_UNREF_COALESCE_WINDOW
+    #define DEFER_UNREF_COALESCE_WINDOW 16
+#endif
+
 // enable custom closure memory allocator
 // user can install custom allocator to alloc defer obj
 #define ENABLE_CUSTOM_CLOSURE_ALLOCATOR
 
 struct _defer_closure_head;
+struct _defer_alloc_chunk;
+struct _defer_unref_head;
 
 /// @brief custom allocator for dyn-defer-closure
 typedef struct _defer_closure_allocator {
@@ -40,6 +118,8 @@ typedef struct _defer_closure_allocator {
 typedef struct _defer_closure_mgr {
     struct _defer_closure_head* fn_chain; // closure stack
     defer_closure_allocator_t*  allocator;
+    struct _defer_alloc_chunk*  alloc_chunks; // spilled memory of `defer_alloc`
+    struct _defer_unref_head*   unref_chain;  // closures of `defer_unref`, newest first
     int                         builtin_buf_max;
     int                         builtin_buf_used;
     char                        builtin_buff[0];
@@ -50,18 +130,116 @@ typedef struct _defer_closure_head {
     struct _defer_closure_head* next;
     void (* callback)(struct _defer_closure_head* self);
 #ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
-    #define CLOSURE_FLAG_USER_ALLOC (1<<0)
-    unsigned long flags; // !!! warning: take care of alignment
+    #define CLOSURE_FLAG_USER_ALLOC  (1<<0)
+    #define CLOSURE_FLAG_MEMORY_ONLY (1<<1) // only releases memory, can be skipped at process exit
+    #define CLOSURE_FLAG_PINNED      (1<<2) // can not be copied byte-wise, `defer_transfer` won't relocate it
+    unsigned int flags; // !!! warning: take care of alignment
 #endif
+    int size; // bytes of closure obj, `defer_transfer` relocates closures one by one
 } defer_closure_head_t;
 
+/// @brief closure of `defer_unref`, drops @pending refs of @obj in one go
+typedef struct _defer_unref_head {
+    defer_closure_head_t       base;
+    struct _defer_unref_head*  unref_next;
+    void*                      obj;
+    long                       pending;
+} defer_unref_head_t;
+
+/// @brief position in closure stack, closures registered after it can be transferred
+typedef struct _defer_mark {
+    defer_closure_head_t* fn_chain;
+    defer_unref_head_t*   unref_chain;
+    int                   builtin_buf_used;
+} defer_mark_t;
+
+/// @brief spilled memory block for `defer_alloc`
+typedef struct _defer_alloc_chunk {
+    struct _defer_alloc_chunk* next;
+    int                        size; // bytes of data
+    int                        used;
+    char                       data[0];
+} defer_alloc_chunk_t;
+
+/// @brief per-thread cache of free chunks, released at thread exit
+typedef struct _defer_alloc_pool {
+    defer_alloc_chunk_t* free_list;
+    int                  count;
+    int                  armed; // thread-exit destructor is set
+} defer_alloc_pool_t;
+
+static inline defer_alloc_pool_t* __defer_alloc_pool(void) {
+    static __thread defer_alloc_pool_t pool;
+    return &pool;
+}
+
+/// @brief thread exit: free cached chunks
+static inline void __defer_alloc_pool_release(void* _pool) {
+    defer_alloc_pool_t*  pool = (defer_alloc_pool_t*)_pool;
+    defer_alloc_chunk_t* chunk = pool->free_list;
+    while(chunk) {
+        defer_alloc_chunk_t* nxt = chunk->next;
+        free(chunk);
+        chunk = nxt;
+    }
+    pool->free_list = NULL;
+    pool->count = 0;
+    pool->armed = 0;
+}
+
+static inline pthread_key_t* __defer_alloc_pool_key(void) {
+    static pthread_key_t key;
+    return &key;
+}
+
+static inline void __defer_alloc_pool_key_init(void) {
+    pthread_key_create(__defer_alloc_pool_key(), __defer_alloc_pool_release);
+}
+
+/// @brief set thread-exit destructor of @pool, before the first chunk is cached
+static inline void __defer_alloc_pool_arm(defer_alloc_pool_t* pool) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, __defer_alloc_pool_key_init);
+    pthread_setspecific(*__defer_alloc_pool_key(), pool);
+    pool->armed = 1;
+}
+
+
+/// @brief slow path of `__new_defer_closure`: builtin buffer is full
+/// keep it out of line, so registration sites only inline the pointer bump
+static __attribute__((noinline, unused)) __DEFER_COLD_ATTR
+defer_closure_head_t* __new_defer_closure_slow(defer_closure_mgr_t*mgr, int size) {
+#ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
+    // try custom allocator
+    if (mgr->allocator) {
+        defer_closure_head_t* out = (defer_closure_head_t*)mgr->allocator->alloc(mgr->allocator, size);
+        if (out) {
+            out->flags = CLOSURE_FLAG_USER_ALLOC;
+            out->size = size;
+            out->next = mgr->fn_chain;
+            mgr->fn_chain = out;
+            return out;
+        }
+    }
+#endif
+
+#ifndef ENABLE_CLOSURE_MEM_FAILURE_DETECT
+    printf("*** no-mem for defer-closure, INCREASE `stack_size` of `defer_init(N, A)`!!! userd:%d rest:%d needed:%d\n",
+        mgr->builtin_buf_used, mgr->builtin_buf_max - mgr->builtin_buf_used, size
+    );
+    // panic !!!
+    raise(SIGSEGV);
+#endif
+
+    return NULL;
+}
 
 /// @brief alloc, init and push a closure obj to stack
 /// @param mgr ptr to closure manager
 /// @param size closure obj size
 /// @return ptr to new allocated closure obj
 static inline defer_closure_head_t* __new_defer_closure(defer_closure_mgr_t*mgr, int size) {
-    if (mgr->builtin_buf_used + size < mgr->builtin_buf_max) {
+    if (__builtin_expect(mgr->builtin_buf_used + size < mgr->builtin_buf_max, 1)) {
         // alloc
         defer_closure_head_t* out = (defer_closure_head_t*)(mgr->builtin_buff + mgr->builtin_buf_used);
         mgr->builtin_buf_used += size;
@@ -70,23 +248,108 @@ static inline defer_closure_head_t* __new_defer_closure(defer_closure_mgr_t*mgr,
 #ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
         out->flags = 0;
 #endif
+        out->size = size;
         // push
         out->next = mgr->fn_chain;
         mgr->fn_chain = out;
         return out;
     }
 
-#ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
-    // try custom allocator
-    if (mgr->allocator) {
-        return mgr->allocator->alloc(mgr->allocator, size);
+    return __new_defer_closure_slow(mgr, size);
+}
+
+/// @brief bump `size` bytes aligned by `align` from [buf + *used, buf + max)
+/// @return ptr to memory, NULL if no enough space
+static inline void* __defer_alloc_bump(char* buf, int* used, int max, int size, int align) {
+    uintptr_t base = (uintptr_t)buf;
+    uintptr_t p    = (base + *used + align - 1) & ~(uintptr_t)(align - 1);
+    // keep the end aligned, so closures pushed later are still aligned
+    uintptr_t end = (p - base) + (uintptr_t)size;
+    end = (end + sizeof(void*) - 1) & ~(uintptr_t)(sizeof(void*) - 1);
+    if (end <= (uintptr_t)max) {
+        *used = (int)end;
+        return (void*)p;
     }
+    return NULL;
+}
+
+/// @brief get a chunk which has at least `size` bytes, reuse cached chunk if possible
+static inline defer_alloc_chunk_t* __defer_alloc_chunk_new(int size) {
+    defer_alloc_pool_t*  pool = __defer_alloc_pool();
+    defer_alloc_chunk_t* chunk;
+    if (size <= DEFER_ALLOC_CHUNK_SIZE && pool->free_list) {
+        chunk = pool->free_list;
+        pool->free_list = chunk->next;
+        pool->count --;
+    } else {
+        if (size < DEFER_ALLOC_CHUNK_SIZE) {
+            size = DEFER_ALLOC_CHUNK_SIZE;
+        }
+        chunk = (defer_alloc_chunk_t*)malloc(sizeof(defer_alloc_chunk_t) + size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->size = size;
+    }
+    chunk->used = 0;
+    return chunk;
+}
+
+/// @brief put all chunks of manager back to pool, free the rest
+static inline void __defer_alloc_chunks_release(defer_closure_mgr_t* mgr) {
+    defer_alloc_pool_t*  pool = __defer_alloc_pool();
+    defer_alloc_chunk_t* chunk = mgr->alloc_chunks;
+    defer_alloc_chunk_t* nxt;
+    while(chunk) {
+        nxt = chunk->next;
+        if (chunk->size == DEFER_ALLOC_CHUNK_SIZE && pool->count < DEFER_ALLOC_POOL_MAX) {
+            if (!pool->armed) {
+                __defer_alloc_pool_arm(pool);
+            }
+            chunk->next = pool->free_list;
+            pool->free_list = chunk;
+            pool->count ++;
+        } else {
+            free(chunk);
+        }
+        chunk = nxt;
+    }
+    mgr->alloc_chunks = NULL;
+}
+
+/// @brief slow path of `__defer_alloc`: builtin buffer is full, alloc from chunks
+static __attribute__((noinline, unused)) __DEFER_COLD_ATTR
+void* __defer_alloc_slow(defer_closure_mgr_t* mgr, size_t size, int align) {
+    void* out;
+
+    // sizes of chunks are `int`
+    if (size > (size_t)INT_MAX - (size_t)align - sizeof(void*)) {
+#ifndef ENABLE_CLOSURE_MEM_FAILURE_DETECT
+        printf("*** defer_alloc: size is too big! needed:%zu\n", size);
+        // panic !!!
+        raise(SIGSEGV);
 #endif
+        return NULL;
+    }
+
+    if (mgr->alloc_chunks) {
+        defer_alloc_chunk_t* chunk = mgr->alloc_chunks;
+        out = __defer_alloc_bump(chunk->data, &chunk->used, chunk->size, (int)size, align);
+        if (out) {
+            return out;
+        }
+    }
+
+    // spill to a new chunk
+    defer_alloc_chunk_t* chunk = __defer_alloc_chunk_new((int)size + align + (int)sizeof(void*));
+    if (chunk) {
+        chunk->next = mgr->alloc_chunks;
+        mgr->alloc_chunks = chunk;
+        return __defer_alloc_bump(chunk->data, &chunk->used, chunk->size, (int)size, align);
+    }
 
 #ifndef ENABLE_CLOSURE_MEM_FAILURE_DETECT
-    printf("*** no-mem for defer-closure, INCREASE `stack_size` of `defer_init(N, A)`!!! userd:%d rest:%d needed:%d\n",
-        mgr->builtin_buf_used, mgr->builtin_buf_max - mgr->builtin_buf_used, size
-    );
+    printf("*** no-mem for defer_alloc! needed:%zu\n", size);
     // panic !!!
     raise(SIGSEGV);
 #endif
@@ -94,14 +357,268 @@ static inline defer_closure_head_t* __new_defer_closure(defer_closure_mgr_t*mgr,
     return NULL;
 }
 
+/// @brief alloc scoped memory from manager, all of it is reclaimed by `__defer_closure_mgr_release`
+/// builtin buffer is used first, then spilled chunks
+/// @param mgr ptr to closure manager
+/// @param size bytes to alloc, sizes over INT_MAX are rejected
+/// @param align alignment, must be power of 2; 0 means pointer alignment
+/// @return ptr to memory
+static inline void* __defer_alloc(defer_closure_mgr_t* mgr, size_t size, int align) {
+    void* out;
+    if (align < (int)sizeof(void*)) {
+        align = (int)sizeof(void*);
+    }
+
+    if (__builtin_expect(size <= (size_t)mgr->builtin_buf_max, 1)) {
+        out = __defer_alloc_bump(mgr->builtin_buff, &mgr->builtin_buf_used, mgr->builtin_buf_max, (int)size, align);
+        if (__builtin_expect(out != NULL, 1)) {
+            return out;
+        }
+    }
+    return __defer_alloc_slow(mgr, size, align);
+}
+
+/// @brief find pending `defer_unref` closure of @obj in recent ones
+static inline defer_unref_head_t* __defer_unref_find(defer_closure_mgr_t* mgr, void* obj) {
+    defer_unref_head_t* u = mgr->unref_chain;
+    int n = DEFER_UNREF_COALESCE_WINDOW;
+    while(u && n -- > 0) {
+        if (u->obj == obj) {
+            return u;
+        }
+        u = u->unref_next;
+    }
+    return NULL;
+}
+
+/// @brief alloc and push a `defer_unref` closure
+static inline defer_unref_head_t* __defer_unref_new(defer_closure_mgr_t* mgr, void* obj, void (*cb)(defer_unref_head_t*)) {
+    defer_unref_head_t* u = (defer_unref_head_t*)__new_defer_closure(mgr, sizeof(defer_unref_head_t));
+    if (u) {
+        u->base.callback = (void (*)(defer_closure_head_t*))cb;
+        u->obj = obj;
+        u->pending = 1;
+        u->unref_next = mgr->unref_chain;
+        mgr->unref_chain = u;
+    }
+    return u;
+}
+
+#ifdef __DEFER_BLOCKS
+
+/// @brief layout of a block literal, see clang Block-ABI
+typedef struct _defer_block_literal {
+    void* isa;
+    int   flags;
+    int   reserved;
+    void (*invoke)(void* self, void* arg);
+    struct {
+        unsigned long reserved;
+        unsigned long size;
+    }* descriptor;
+} __defer_block_literal_t;
+
+/// @brief closure obj's head with blocks, the block literal is copied to @block_offset
+typedef struct _defer_block_closure {
+    defer_closure_head_t base;
+    int                  block_offset;
+} __defer_block_closure_t;
+
+static inline int __defer_block_size(void* blk) {
+    int size = (int)((__defer_block_literal_t*)blk)->descriptor->size;
+    return (size + (int)sizeof(void*) - 1) & ~((int)sizeof(void*) - 1);
+}
+
+static inline void __defer_block_call(defer_closure_head_t* self) {
+    __defer_block_literal_t* blk = (__defer_block_literal_t*)((char*)self + ((__defer_block_closure_t*)self)->block_offset);
+    blk->invoke(blk, self);
+}
+
+///
+/// @brief alloc and push a closure, copy captured values from @tmp and the block literal after them.
+///        the block is copied byte-wise, not by `Block_copy`: no heap, and like a gcc nested function,
+///        `__block` vars it refers to stay in the frame registering it.
+/// @param tmp closure obj on stack, with captured values
+/// @param size size of @tmp
+/// @param blk block literal, called with the new closure obj
+///
+static inline defer_closure_head_t* __defer_block_closure_new(defer_closure_mgr_t* mgr, defer_closure_head_t* tmp, int size, void* blk) {
+    int off = (size + (int)sizeof(void*) - 1) & ~((int)sizeof(void*) - 1);
+    int bsize = __defer_block_size(blk);
+    defer_closure_head_t* out = __new_defer_closure(mgr, off + bsize);
+    if (out) {
+        memcpy(out + 1, tmp + 1, size - sizeof(defer_closure_head_t));
+#ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
+        out->flags |= tmp->flags;
+#endif
+        out->callback = __defer_block_call;
+        ((__defer_block_closure_t*)out)->block_offset = off;
+        memcpy((char*)out + off, blk, bsize);
+    }
+    return out;
+}
+
+static inline void __defer_unref_block_call(defer_closure_head_t* self) {
+    __defer_block_literal_t* blk = (__defer_block_literal_t*)((defer_unref_head_t*)self + 1);
+    blk->invoke(blk, self);
+}
+
+/// @brief same as `__defer_unref_new`, the block literal is copied after the closure
+static inline defer_unref_head_t* __defer_unref_new_block(defer_closure_mgr_t* mgr, void* obj, void* blk) {
+    int bsize = __defer_block_size(blk);
+    defer_unref_head_t* u = (defer_unref_head_t*)__new_defer_closure(mgr, (int)sizeof(defer_unref_head_t) + bsize);
+    if (u) {
+        u->base.callback = __defer_unref_block_call;
+        u->obj = obj;
+        u->pending = 1;
+        u->unref_next = mgr->unref_chain;
+        mgr->unref_chain = u;
+        memcpy(u + 1, blk, bsize);
+    }
+    return u;
+}
+
+#endif // __DEFER_BLOCKS
+
+/// @brief take a mark, `defer_unref` after it is never grouped into closures before it:
+/// those stay in @mgr when the closures after the mark are transferred.
+static inline defer_mark_t __defer_mark(defer_closure_mgr_t* mgr) {
+    defer_mark_t m = { mgr->fn_chain, mgr->unref_chain, mgr->builtin_buf_used };
+    mgr->unref_chain = NULL;
+    return m;
+}
+
+/// @brief copy closure @c into @mgr: into builtin buffer (keep the address modulo 16, so the copied
+/// object keeps its alignment), or by custom allocator of @mgr when builtin buffer is full
+/// @return the copy, NULL if no memory
+static inline defer_closure_head_t* __defer_closure_relocate(defer_closure_mgr_t* mgr, defer_closure_head_t* c) {
+    char* p    = mgr->builtin_buff + mgr->builtin_buf_used;
+    int   skip = (int)(((uintptr_t)c - (uintptr_t)p) & 15);
+    defer_closure_head_t* n = NULL;
+
+    if (mgr->builtin_buf_used + skip + c->size <= mgr->builtin_buf_max) {
+        n = (defer_closure_head_t*)(p + skip);
+        mgr->builtin_buf_used += skip + c->size;
+        memcpy(n, c, c->size);
+        return n;
+    }
+#ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
+    if (mgr->allocator) {
+        n = (defer_closure_head_t*)mgr->allocator->alloc(mgr->allocator, c->size);
+        if (n) {
+            memcpy(n, c, c->size);
+            n->flags |= CLOSURE_FLAG_USER_ALLOC;
+        }
+    }
+#endif
+    return n;
+}
+
+/// @brief move closures registered after @mark from @src to the top of @dst, keep their order
+/// closures in builtin buffer of @src are relocated into @dst one by one (bytes are copied),
+/// closures from custom allocator are moved by re-linking only. memory of `defer_alloc` is not copied.
+/// @return boolean, 0 means nothing is moved: @mark is not in @src any more (eg: an older mark was transferred),
+///         @dst has no memory for relocating, allocators differ,
+///         or a closure in builtin buffer is pinned (eg: C++ lambda with non-trivially-copyable captures).
+static inline int __defer_transfer(defer_closure_mgr_t* src, defer_mark_t mark, defer_closure_mgr_t* dst) {
+    char* from     = src->builtin_buff + mark.builtin_buf_used;
+    char* to       = src->builtin_buff + src->builtin_buf_used;
+    int   dst_used = dst->builtin_buf_used;
+    defer_closure_head_t*  c;
+    defer_closure_head_t*  nxt;
+    defer_closure_head_t*  copies = NULL;
+    defer_closure_head_t** tail = &copies;
+    defer_closure_head_t*  head = NULL;
+
+    if (src == dst || src->fn_chain == mark.fn_chain) {
+        if (src != dst) {
+            src->unref_chain = mark.unref_chain;
+        }
+        return 1;
+    }
+
+    // check before changing anything, a mark not found in the chain is stale
+    if (mark.builtin_buf_used > src->builtin_buf_used) {
+        return 0;
+    }
+    for (c = src->fn_chain; c != mark.fn_chain; c = c->next) {
+        if (!c) {
+            return 0;
+        }
+#ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
+        // closure from custom allocator is released by the allocator of its owner
+        if ((c->flags & CLOSURE_FLAG_USER_ALLOC) && src->allocator != dst->allocator) {
+            return 0;
+        }
+        if ((c->flags & CLOSURE_FLAG_PINNED) && !(c->flags & CLOSURE_FLAG_USER_ALLOC)) {
+            return 0;
+        }
+#endif
+    }
+
+    // copy closures in builtin buffer of @src, linked in order of @src
+    for (c = src->fn_chain; c != mark.fn_chain; c = c->next) {
+        if ((char*)c >= from && (char*)c < to) {
+            defer_closure_head_t* n = __defer_closure_relocate(dst, c);
+            if (!n) {
+                // undo, @src is not changed yet
+                *tail = NULL;
+                for (c = copies; c; c = nxt) {
+                    nxt = c->next;
+#ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
+                    if (c->flags & CLOSURE_FLAG_USER_ALLOC) {
+                        dst->allocator->release(dst->allocator, c);
+                    }
+#endif
+                }
+                dst->builtin_buf_used = dst_used;
+                return 0;
+            }
+            *tail = n;
+            tail  = &n->next;
+        }
+    }
+    *tail = NULL;
+
+    // re-link: copies replace closures in builtin buffer, the others are moved as is
+    tail = &head;
+    for (c = src->fn_chain; c != mark.fn_chain; c = nxt) {
+        defer_closure_head_t* n = c;
+        nxt = c->next;
+        if ((char*)c >= from && (char*)c < to) {
+            n = copies;
+            copies = copies->next;
+        }
+        *tail = n;
+        tail  = &n->next;
+    }
+    *tail = dst->fn_chain;
+    dst->fn_chain = head;
+
+    src->fn_chain = mark.fn_chain;
+    // moved `defer_unref` closures are not grouped any more
+    src->unref_chain = mark.unref_chain;
+    return 1;
+}
+
 /// @brief call all closure, then cleanup all
 /// @param mgr ptr to closure manager
-static inline void __defer_closure_mgr_release(void* _mgr) {
-    defer_closure_mgr_t* mgr = (defer_closure_mgr_t*)_mgr;
+/// @param skip_flags closures with any of these flags are not called, nor released
+static inline void __defer_closure_mgr_release_ex(defer_closure_mgr_t* mgr, unsigned long skip_flags) {
     defer_closure_head_t* c = mgr->fn_chain;
     defer_closure_head_t* nxt;
+    mgr->fn_chain = NULL;
+    mgr->unref_chain = NULL;
     while(c) {
         nxt = c->next;
+#ifdef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
+        if (c->flags & skip_flags) {
+            c = nxt;
+            continue;
+        }
+#else
+        (void)skip_flags;
+#endif
         // call callback
         c->callback(c);
         // release
@@ -112,17 +629,85 @@ static inline void __defer_closure_mgr_release(void* _mgr) {
 #endif
         c = nxt;
     }
+    // memory of `defer_alloc` may be used by closures, reclaim it at last
+    if (mgr->alloc_chunks) {
+        __defer_alloc_chunks_release(mgr);
+    }
+}
+
+/// @brief call all closure, then cleanup all
+/// @param mgr ptr to closure manager
+static inline void __defer_closure_mgr_release(void* _mgr) {
+    __defer_closure_mgr_release_ex((defer_closure_mgr_t*)_mgr, 0);
 }
 
+#ifdef __DEFER_BLOCKS
+/// clang ends the lifetime of locals declared after `defer_init` before its cleanup calls the closures,
+/// so optimized code may drop stores to them. it emits no lifetime markers for C locals declared after
+/// a label in the same scope, a label in `defer_init` keeps their storage alive as gcc does.
+#define __defer_scope_label(line) __defer_scope_label_x(line)
+#define __defer_scope_label_x(line) __defer_scope_ ## line: __attribute__((unused));
+#else
+#define __defer_scope_label(line)
+#endif
+
 #define defer_init(stack_size, closure_allocator) \
+    __defer_scope_label(__LINE__) \
     __attribute__((cleanup(__defer_closure_mgr_release))) \
     struct _defer_mgr_local { \
         defer_closure_mgr_t base; \
         unsigned char stack[stack_size]; \
     } __defer_mgr = { \
-        {NULL, closure_allocator, stack_size, 0} \
+        {NULL, closure_allocator, NULL, NULL, stack_size, 0} \
     }
 
+#ifdef __DEFER_BLOCKS
+
+#define gen_defer_closure_decl() \
+    struct _closure_obj { \
+        defer_closure_head_t base; \
+        int __block_offset
+
+#define gen_defer_closure_field_decl(var_name, cap_val) \
+        typeof(cap_val) var_name
+
+#define gen_defer_closure_init() \
+    gen_defer_closure_init_mgr(&__defer_mgr.base)
+
+/// captured values are saved in a closure obj on stack, then copied with the block
+#define gen_defer_closure_init_mgr(mgr) \
+    } __closure_tmp, *__curr_closure = &__closure_tmp; \
+    defer_closure_mgr_t* __closure_mgr = (mgr); \
+    __closure_tmp.base.flags = 0; \
+    {
+
+#define gen_defer_closure_field_init(var_name, cap_val) \
+        __curr_closure->var_name = cap_val
+
+#define gen_defer_closure_cb_field_init_part1() \
+        __curr_closure = (typeof(__curr_closure)) __defer_block_closure_new(__closure_mgr, \
+            &__closure_tmp.base, sizeof(__closure_tmp), (void*) ^(struct _closure_obj* __curr_closure) {
+
+/// block literals take no attributes, hot and cold variants are the same
+#define gen_defer_closure_cb_field_init_part1_hot() \
+    gen_defer_closure_cb_field_init_part1()
+
+#define gen_defer_closure_cb_field_init_part2_hot(code) \
+    gen_defer_closure_cb_field_init_part2(code)
+
+#define gen_defer_closure_local_var(var_name) \
+                typeof(__curr_closure->var_name) var_name = __curr_closure->var_name
+
+#define gen_defer_closure_cb_field_init_part2(code) \
+                code ; \
+            })
+
+#define gen_defer_end() \
+    }\
+    __curr_closure ? 1: 0
+
+#else // gcc nested functions
+
 #define gen_defer_closure_decl() \
     struct _closure_obj { \
         defer_closure_head_t base
@@ -131,7 +716,10 @@ static inline void __defer_closure_mgr_release(void* _mgr) {
         typeof(cap_val) var_name
 
 #define gen_defer_closure_init() \
-    } *__curr_closure = (typeof(__curr_closure)) __new_defer_closure(&__defer_mgr.base, sizeof(*__curr_closure)); \
+    gen_defer_closure_init_mgr(&__defer_mgr.base)
+
+#define gen_defer_closure_init_mgr(mgr) \
+    } *__curr_closure = (typeof(__curr_closure)) __new_defer_closure(mgr, sizeof(*__curr_closure)); \
     if (__curr_closure) {
 
 #define gen_defer_closure_field_init(var_name, cap_val) \
@@ -139,7 +727,18 @@ static inline void __defer_closure_mgr_release(void* _mgr) {
 
 #define gen_defer_closure_cb_field_init_part1() \
         __curr_closure->base.callback = (typeof(__curr_closure->base.callback)) ({ \
-            void __fn(struct _closure_obj* __curr_closure) {
+            __DEFER_COLD_ATTR void __fn(struct _closure_obj* __curr_closure) {
+
+/// hot variant of part1/part2, closure body is never `cold`
+#define gen_defer_closure_cb_field_init_part1_hot() \
+        __curr_closure->base.callback = (typeof(__curr_closure->base.callback)) ({ \
+            void __fn_hot(struct _closure_obj* __curr_closure) {
+
+#define gen_defer_closure_cb_field_init_part2_hot(code) \
+                code ; \
+            }; \
+            __fn_hot; \
+        })
 
 #define gen_defer_closure_local_var(var_name) \
                 typeof(__curr_closure->var_name) var_name = __curr_closure->var_name
@@ -155,10 +754,31 @@ static inline void __defer_closure_mgr_release(void* _mgr) {
     __curr_closure ? 1: 0
 
 
+#endif // __DEFER_BLOCKS
+
 #define defer_arg(arg_pos) __curr_closure->arg ## arg_pos
 
 // -----------------------------------------------------------------------------
 
+/// alloc temp memory from defer manager, it is reclaimed in one go when exiting the function scope
+/// no closure and no free() is needed for it, it is just a pointer bump in most case.
+/// builtin buffer of `defer_init` is used first, then pooled chunks when it is full.
+/// chunks cached by a thread are freed when it exits.
+/// @param size bytes to alloc, up to INT_MAX (minus alignment); bigger ones fail as no-mem
+/// @param align alignment, must be power of 2; 0 means default (pointer) alignment
+/// @return ptr to memory, NULL means memory failed!
+///
+/// example:
+/// int main() {
+///    defer_init(4096, NULL);
+///    char* buf = defer_alloc(256, 0);
+///    snprintf(buf, 256, "no free() is needed");
+///    return 0;
+/// }
+///
+#define defer_alloc(size, align) \
+    __defer_alloc(&__defer_mgr.base, (size_t)(size), (int)(align))
+
 /// register a derfer statement
 /// it will be called when exiting the function scope
 /// @param code statement that will be called later
@@ -172,6 +792,19 @@ static inline void __defer_closure_mgr_release(void* _mgr) {
     gen_defer_end(); \
 })
 
+///
+/// same as `defer`, but the closure body always stays in hot text,
+/// for cleanups that run on every call when `ENABLE_DEFER_COLD_CLEANUP` is on
+///
+#define defer_hot(code) \
+({\
+    gen_defer_closure_decl(); \
+    gen_defer_closure_init()  \
+    gen_defer_closure_cb_field_init_part1_hot() \
+    gen_defer_closure_cb_field_init_part2_hot(code); \
+    gen_defer_end(); \
+})
+
 ///
 /// create a closure that capture value provided by @cap_var1 and register it as defer statement
 /// @param cap_val1 is value that is going tobe captured; closure will create a local-var with same name as @cap_val1
@@ -371,4 +1004,336 @@ static inline void __defer_closure_mgr_release(void* _mgr) {
 
 #define defer4(cap_var1, cap_var2, cap_var3, cap_var4, code) defer4_named(cap_var1, cap_var1, cap_var2, cap_var2, cap_var3, cap_var3, cap_var4, cap_var4, code)
 
+/// @return ptr to closure manager of current function, type `defer_closure_mgr_t*`
+#define defer_mgr() (&__defer_mgr.base)
+
+/// @return current position in closure stack of current function, type `defer_mark_t`
+/// `defer_unref` of an object after the mark is not grouped with one before it.
+#define defer_mark() __defer_mark(&__defer_mgr.base)
+
+///
+/// @brief hand over closures registered after @mark to another manager (eg: caller's manager),
+///        they will be called when @dst_mgr is released, not current function.
+///        closures in builtin buffer are copied into @dst_mgr (its custom allocator is used when its
+///        builtin buffer is full), so they must not access local vars of current function by-ref
+///        (capture them by value instead: defer1, defer2...).
+///        memory of `defer_alloc` is never transferred.
+///        a mark is stale once an older mark is transferred, transferring it fails.
+///        rejected at compile time by gcc at -O0, see `DEFER_OUTLIVE_OK`.
+/// @param mark value of `defer_mark()`, taken before the closures are registered
+/// @param dst_mgr target manager, `defer_closure_mgr_t*`
+/// @return boolean, 0 means failed and closures stay in current function! 1 means ok
+///
+/// example:
+/// char* make_buf(defer_closure_mgr_t* owner) {
+///    defer_init(1024, NULL);
+///    defer_mark_t m = defer_mark();
+///    char* s = malloc(100);
+///    defer1(s, free(s));
+///    if (!init_buf(s)) { return NULL; } // free(s) is called here
+///    defer_transfer(m, owner);          // success: free(s) is called when owner is released
+///    return s;
+/// }
+///
+#define defer_transfer(mark, dst_mgr) \
+({ \
+    __defer_outlive_check("defer_transfer"); \
+    __defer_transfer(&__defer_mgr.base, (mark), (dst_mgr)); \
+})
+
+///
+/// @brief drop a reference of @p when exiting the function scope.
+///        drops of the same object in one scope are grouped into one closure,
+///        so only one atomic `p->counter_field -= n` is issued for each object,
+///        and `destroy_fn(p)` is called if the counter reaches zero.
+///        grouped drops are issued at the position of the first one (the latest in LIFO order).
+/// @param p ptr to object
+/// @param counter_field name of the integer ref-counter field of *p
+/// @param destroy_fn function (or function-like macro) to destroy the object
+/// @return boolean, 0 means memory failed! 1 means ok
+///
+/// example:
+/// void handle(obj_t* o) {
+///    defer_init(1024, NULL);
+///    obj_ref(o);
+///    defer_unref(o, refs, obj_destroy);
+///    obj_ref(o);
+///    defer_unref(o, refs, obj_destroy); // grouped with the first one
+/// }
+///
+#define defer_unref(p, counter_field, destroy_fn) \
+({ \
+    typeof(p) __unref_obj = (p); \
+    defer_unref_head_t* __unref = __defer_unref_find(&__defer_mgr.base, (void*)__unref_obj); \
+    if (__unref) { \
+        __unref->pending ++; \
+    } else { \
+        __unref = __defer_unref_new_cb(&__defer_mgr.base, (void*)__unref_obj, \
+            void, (defer_unref_head_t* __u), { \
+                typeof(__unref_obj) __obj = (typeof(__unref_obj))__u->obj; \
+                if (__atomic_sub_fetch(&__obj->counter_field, __u->pending, __ATOMIC_ACQ_REL) == 0) { \
+                    destroy_fn(__obj); \
+                } \
+            }); \
+    } \
+    __unref ? 1: 0; \
+})
+
+#ifdef __DEFER_BLOCKS
+    #define __defer_unref_new_cb(mgr, obj, ret, params, body) \
+        __defer_unref_new_block(mgr, obj, (void*) ^ret params body)
+#else
+    #define __defer_unref_new_cb(mgr, obj, ret, params, body) \
+        __defer_unref_new(mgr, obj, ({ ret __fn_hot params body; __fn_hot; }))
+#endif
+
+///
+/// @brief register one closure covering @count elements of @array,
+///        `fn(array[i])` is called for each element in reverse order when exiting the function scope.
+///        only the array pointer and count are captured, so the array itself must be alive until then.
+/// @param array pointer to first element (or array)
+/// @param count count of elements
+/// @param fn function (or function-like macro) called with each element
+/// @return boolean, 0 means memory failed! 1 means ok
+///
+/// example:
+/// int main() {
+///    char* bufs[1000];
+///    for (int i = 0; i < 1000; i ++) { bufs[i] = malloc(100); }
+///    defer_each(bufs, 1000, free); // one closure for all of them
+///    return 0;
+/// }
+///
+#define defer_each(array, count, fn) \
+({ \
+    gen_defer_closure_decl(); \
+    gen_defer_closure_field_decl(arg0, &(array)[0]); \
+    gen_defer_closure_field_decl(arg1, (size_t)(count)); \
+    gen_defer_closure_init()  \
+    gen_defer_closure_field_init(arg0, &(array)[0]); \
+    gen_defer_closure_field_init(arg1, (size_t)(count)); \
+    gen_defer_closure_cb_field_init_part1() \
+    gen_defer_closure_cb_field_init_part2({ \
+        size_t __i = defer_arg(1); \
+        while (__i -- > 0) { \
+            fn(defer_arg(0)[__i]); \
+        } \
+    }); \
+    gen_defer_end(); \
+})
+
+///
+/// @brief same as `defer_each`, but elements are given by range [@begin, @end)
+///        @begin can be an array name, it decays to a pointer to the first element
+///
+#define defer_range(begin, end, fn) \
+({ \
+    gen_defer_closure_decl(); \
+    gen_defer_closure_field_decl(arg0, (begin) + 0); \
+    gen_defer_closure_field_decl(arg1, (end) + 0); \
+    gen_defer_closure_init()  \
+    gen_defer_closure_field_init(arg0, (begin) + 0); \
+    gen_defer_closure_field_init(arg1, (end) + 0); \
+    gen_defer_closure_cb_field_init_part1() \
+    gen_defer_closure_cb_field_init_part2({ \
+        typeof(defer_arg(1)) __p = defer_arg(1); \
+        while (__p != defer_arg(0)) { \
+            fn(*-- __p); \
+        } \
+    }); \
+    gen_defer_end(); \
+})
+
+// ====================[ process / thread lifetime defer ]======================
+
+/// enable process-lifetime and thread-lifetime defer registries:
+/// `defer_process*` closures are called at process exit, `defer_thread*` closures at thread exit,
+/// both in LIFO order. closures registered by `*_mem` are memory-only,
+/// they are skipped at process exit in fast-exit mode, the kernel reclaims the memory anyway.
+/// link with -pthread
+#if 0
+    #define ENABLE_DEFER_REGISTRY
+#endif
+
+#ifdef ENABLE_DEFER_REGISTRY
+
+#ifndef ENABLE_CUSTOM_CLOSURE_ALLOCATOR
+    #error "ENABLE_DEFER_REGISTRY needs ENABLE_CUSTOM_CLOSURE_ALLOCATOR"
+#endif
+
+#include <pthread.h>
+
+static inline void* __defer_heap_alloc(defer_closure_allocator_t* self, int size) {
+    (void)self;
+    return malloc(size);
+}
+
+static inline void __defer_heap_release(defer_closure_allocator_t* self, void* obj) {
+    (void)self;
+    free(obj);
+}
+
+// registries are weak symbols, so all translation units share one
+__attribute__((weak)) defer_closure_allocator_t defer_heap_allocator = {
+    __defer_heap_alloc, __defer_heap_release
+};
+
+/// no builtin buffer, all closures come from heap
+__attribute__((weak)) defer_closure_mgr_t __defer_process_mgr = {
+    NULL, &defer_heap_allocator, NULL, NULL, 0, 0
+};
+__attribute__((weak)) __thread defer_closure_mgr_t __defer_thread_mgr = {
+    NULL, &defer_heap_allocator, NULL, NULL, 0, 0
+};
+__attribute__((weak)) pthread_mutex_t __defer_process_lock = PTHREAD_MUTEX_INITIALIZER;
+__attribute__((weak)) pthread_once_t  __defer_registry_once = PTHREAD_ONCE_INIT;
+__attribute__((weak)) pthread_key_t   __defer_thread_key;
+__attribute__((weak)) int             __defer_fast_exit_flag;
+
+/// @brief thread exit: call closures of thread registry, memory-only ones included
+static inline void __defer_thread_registry_release(void* mgr) {
+    __defer_closure_mgr_release_ex((defer_closure_mgr_t*)mgr, 0);
+}
+
+/// @brief process exit: thread registry of exiting thread, then process registry.
+/// closures are detached under the lock and called without it: they may register new closures,
+/// which are called in the next round.
+static inline void __defer_process_registry_release(void) {
+    unsigned long skip = __atomic_load_n(&__defer_fast_exit_flag, __ATOMIC_ACQUIRE) ? CLOSURE_FLAG_MEMORY_ONLY : 0;
+    defer_closure_mgr_t detached = { NULL, &defer_heap_allocator, NULL, NULL, 0, 0 };
+    __defer_closure_mgr_release_ex(&__defer_thread_mgr, skip);
+    for (;;) {
+        pthread_mutex_lock(&__defer_process_lock);
+        detached.fn_chain = __defer_process_mgr.fn_chain;
+        __defer_process_mgr.fn_chain = NULL;
+        __defer_process_mgr.unref_chain = NULL;
+        pthread_mutex_unlock(&__defer_process_lock);
+        if (!detached.fn_chain) {
+            break;
+        }
+        __defer_closure_mgr_release_ex(&detached, skip);
+    }
+}
+
+static inline void __defer_registry_init(void) {
+    pthread_key_create(&__defer_thread_key, __defer_thread_registry_release);
+    atexit(__defer_process_registry_release);
+}
+
+/// @return process registry, locked
+static inline defer_closure_mgr_t* __defer_process_registry_lock(void) {
+    pthread_once(&__defer_registry_once, __defer_registry_init);
+    pthread_mutex_lock(&__defer_process_lock);
+    return &__defer_process_mgr;
+}
+
+/// @return thread registry of current thread
+static inline defer_closure_mgr_t* __defer_thread_registry_lock(void) {
+    pthread_once(&__defer_registry_once, __defer_registry_init);
+    if (!__defer_thread_mgr.fn_chain) {
+        // (re-)arm the thread-exit destructor
+        pthread_setspecific(__defer_thread_key, &__defer_thread_mgr);
+    }
+    return &__defer_thread_mgr;
+}
+
+static inline void __defer_registry_unlock(defer_closure_mgr_t* mgr) {
+    if (mgr == &__defer_process_mgr) {
+        pthread_mutex_unlock(&__defer_process_lock);
+    }
+}
+
+/// @brief fast-exit mode: skip memory-only closures of registries at process exit
+/// @param on boolean
+static inline void defer_set_fast_exit(int on) {
+    __atomic_store_n(&__defer_fast_exit_flag, on, __ATOMIC_RELEASE);
+}
+
+/// @brief turn fast-exit mode on, then `exit(status)`
+#define defer_fast_exit(status) \
+    (defer_set_fast_exit(1), exit(status))
+
+#define __defer_registry(registry, flag, code) \
+({ \
+    __defer_outlive_check("defer_process/defer_thread"); \
+    defer_closure_mgr_t* __registry_mgr = registry(); \
+    int __registry_ok = ({ \
+        gen_defer_closure_decl(); \
+        gen_defer_closure_init_mgr(__registry_mgr) \
+        __curr_closure->base.flags |= (flag); \
+        gen_defer_closure_cb_field_init_part1() \
+        gen_defer_closure_cb_field_init_part2(code); \
+        gen_defer_end(); \
+    }); \
+    __defer_registry_unlock(__registry_mgr); \
+    __registry_ok; \
+})
+
+#define __defer_registry1(registry, flag, cap_var1, code) \
+({ \
+    __defer_outlive_check("defer_process/defer_thread"); \
+    defer_closure_mgr_t* __registry_mgr = registry(); \
+    int __registry_ok = ({ \
+        gen_defer_closure_decl(); \
+        gen_defer_closure_field_decl(cap_var1, cap_var1); \
+        gen_defer_closure_init_mgr(__registry_mgr) \
+        __curr_closure->base.flags |= (flag); \
+        gen_defer_closure_field_init(cap_var1, cap_var1); \
+        gen_defer_closure_cb_field_init_part1() \
+        gen_defer_closure_local_var(cap_var1); \
+        gen_defer_closure_cb_field_init_part2(code); \
+        gen_defer_end(); \
+    }); \
+    __defer_registry_unlock(__registry_mgr); \
+    __registry_ok; \
+})
+
+// -----------------------------------------------------------------------------
+
+///
+/// register a statement that will be called at process exit (`exit()` or return from `main`)
+/// closures outlive the function registering them, so they must access captured values only,
+/// not local vars by-ref. rejected at compile time by gcc at -O0, see `DEFER_OUTLIVE_OK`.
+/// @return boolean, 0 means memory failed! 1 means ok
+///
+/// example:
+/// int fd = open(path, O_WRONLY);
+/// defer_process1(fd, { fsync(fd); close(fd); }); // still called in fast-exit mode
+/// char* cache = malloc(1 << 30);
+/// defer_process_mem1(cache, free(cache));         // skipped in fast-exit mode
+///
+#define defer_process(code) \
+    __defer_registry(__defer_process_registry_lock, 0, code)
+
+/// @brief capture value of @cap_var1, same as `defer1`
+#define defer_process1(cap_var1, code) \
+    __defer_registry1(__defer_process_registry_lock, 0, cap_var1, code)
+
+/// @brief memory-only version of `defer_process`
+#define defer_process_mem(code) \
+    __defer_registry(__defer_process_registry_lock, CLOSURE_FLAG_MEMORY_ONLY, code)
+
+/// @brief memory-only version of `defer_process1`
+#define defer_process_mem1(cap_var1, code) \
+    __defer_registry1(__defer_process_registry_lock, CLOSURE_FLAG_MEMORY_ONLY, cap_var1, code)
+
+///
+/// register a statement that will be called when current thread exits,
+/// or at process exit for the thread calling `exit()`.
+/// memory-only closures are skipped only at process exit in fast-exit mode.
+///
+#define defer_thread(code) \
+    __defer_registry(__defer_thread_registry_lock, 0, code)
+
+#define defer_thread1(cap_var1, code) \
+    __defer_registry1(__defer_thread_registry_lock, 0, cap_var1, code)
+
+#define defer_thread_mem(code) \
+    __defer_registry(__defer_thread_registry_lock, CLOSURE_FLAG_MEMORY_ONLY, code)
+
+#define defer_thread_mem1(cap_var1, code) \
+    __defer_registry1(__defer_thread_registry_lock, CLOSURE_FLAG_MEMORY_ONLY, cap_var1, code)
+
+#endif // ENABLE_DEFER_REGISTRY
+
 #endif
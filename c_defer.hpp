@@ -0,0 +1,468 @@
+/**
+ * c_defer.hpp
+ * implement defer & scope_guard library for C++, closures are lambdas
+ * closure managers are the same `defer_closure_mgr_t` as c_defer.h,
+ * so C and C++ frames can share one manager.
+ * by: cloudsong @ 2024
+ * License: MIT
+ */
+
+#ifndef __simple_c_defer_hpp__
+#define __simple_c_defer_hpp__
+
+#include "c_defer.h"
+#include "c_scopeguard.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// -----------------------------------------------------------------------------
+
+namespace c_defer {
+
+/// @brief layout of a closure obj: common head, then the lambda
+template <class F>
+struct closure {
+    static_assert(alignof(F) <= alignof(defer_closure_head_t),
+        "over-aligned captures are not supported by defer closure");
+
+    static constexpr std::size_t fn_offset =
+        (sizeof(defer_closure_head_t) + alignof(F) - 1) / alignof(F) * alignof(F);
+
+    /// keep closure size aligned, so closures pushed later are still aligned
+    static constexpr std::size_t size =
+        (fn_offset + sizeof(F) + alignof(defer_closure_head_t) - 1)
+            / alignof(defer_closure_head_t) * alignof(defer_closure_head_t);
+
+    static F* fn(defer_closure_head_t* self) noexcept {
+        return std::launder(reinterpret_cast<F*>(reinterpret_cast<char*>(self) + fn_offset));
+    }
+
+    static void call(defer_closure_head_t* self) noexcept {
+        F* f = fn(self);
+        (*f)();
+        f->~F();
+    }
+};
+
+///
+/// @brief register a lambda into closure manager @mgr, the manager can be one of a C frame.
+///        the lambda is moved into the manager's memory, no heap allocation.
+/// @return boolean, false means memory failed!
+///
+template <class F>
+inline bool push(defer_closure_mgr_t* mgr, F&& f) noexcept {
+    using fn_t = typename std::decay<F>::type;
+    static_assert(std::is_nothrow_constructible<fn_t, F&&>::value,
+        "captures of defer closure must be nothrow move/copy constructible");
+
+    defer_closure_head_t* c = __new_defer_closure(mgr, (int)closure<fn_t>::size);
+    if (!c) {
+        return false;
+    }
+    ::new (static_cast<void*>(closure<fn_t>::fn(c))) fn_t(std::forward<F>(f));
+    c->callback = &closure<fn_t>::call;
+    if (!std::is_trivially_copyable<fn_t>::value) {
+        c->flags |= CLOSURE_FLAG_PINNED;
+    }
+    return true;
+}
+
+///
+/// @brief closure manager with @N bytes of builtin buffer,
+///        same memory layout as the local manager of C `defer_init(N, A)`.
+///
+template <int N>
+struct frame_mgr {
+    defer_closure_mgr_t base;
+    unsigned char       stack[N];
+
+    explicit frame_mgr(defer_closure_allocator_t* allocator = nullptr) noexcept {
+        base.fn_chain         = nullptr;
+        base.allocator        = allocator;
+        base.alloc_chunks     = nullptr;
+        base.unref_chain      = nullptr;
+        base.builtin_buf_max  = N;
+        base.builtin_buf_used = 0;
+    }
+
+    ~frame_mgr() noexcept {
+        __defer_closure_mgr_release(&base);
+    }
+
+    frame_mgr(const frame_mgr&) = delete;
+    frame_mgr& operator=(const frame_mgr&) = delete;
+
+    template <class F>
+    bool push(F&& f) noexcept {
+        return c_defer::push(&base, std::forward<F>(f));
+    }
+
+    /// @brief push a closure accessing outer vars by-ref (`defer`)
+    template <class F>
+    bool push_ref(F&& f) noexcept {
+        return c_defer::push(&base, std::forward<F>(f));
+    }
+};
+
+static_assert(std::is_standard_layout<frame_mgr<16>>::value && offsetof(frame_mgr<16>, base) == 0,
+    "frame_mgr must be usable as defer_closure_mgr_t");
+
+/// @brief guard of `scope_exit`, calls the lambda in destructor
+template <class F>
+struct scope_guard {
+    F fn;
+    ~scope_guard() noexcept {
+        fn();
+    }
+};
+
+template <class F>
+inline scope_guard<typename std::decay<F>::type> make_scope_guard(F&& f) noexcept {
+    return { std::forward<F>(f) };
+}
+
+} // namespace c_defer
+
+// -----------------------------------------------------------------------------
+// macros of c_defer.h / c_scopeguard.h depend on gcc nested functions,
+// replace them with lambda versions. the API is the same.
+
+#undef defer_init
+#undef defer
+#undef defer_hot
+#undef defer_arg
+#undef defer1
+#undef defer1_named
+#undef defer1_ex
+#undef defer2
+#undef defer2_named
+#undef defer2_ex
+#undef defer3
+#undef defer3_named
+#undef defer3_ex
+#undef defer4
+#undef defer4_named
+#undef defer4_ex
+#undef defer_each
+#undef defer_range
+#undef defer_unref
+
+#undef scope_exit
+#undef scope_exit_hot
+#undef scope_arg
+#undef scope_exit1
+#undef scope_exit1_named
+#undef scope_exit1_ex
+#undef scope_exit2
+#undef scope_exit2_named
+#undef scope_exit2_ex
+#undef scope_exit3
+#undef scope_exit3_named
+#undef scope_exit3_ex
+#undef scope_exit4
+#undef scope_exit4_named
+#undef scope_exit4_ex
+
+/// init defer on stack, `defer_alloc`, `defer_mgr`, `defer_mark` and `defer_transfer` of c_defer.h work with it.
+/// closures moved by `defer_transfer` are copied byte-wise, closures with non-trivially-copyable captures
+/// (eg: `std::string`) are pinned: `defer_transfer` fails and they stay in current frame.
+///
+/// !!! warning: the manager is declared by `defer_init`, so it is destroyed after every local declared later.
+/// closures run then, these locals are already destroyed (unlike C, where locals have no destructors).
+/// `defer` accesses outer vars by-ref: use it only with vars declared before `defer_init`.
+/// `defer1`...`defer4` capture the named values only, copies or moves (`defer_move1`) live in the closure.
+///
+/// example:
+/// std::string name = "n";
+/// defer_init(256, nullptr);
+/// defer(log(name));                 // ok: declared before defer_init
+/// std::string tmp = name + ".tmp";
+/// defer(unlink(tmp.c_str()));       // !!! wrong: tmp is destroyed before the closure runs
+/// defer1(tmp, unlink(tmp.c_str())); // ok: the closure owns a copy
+#define defer_init(stack_size, closure_allocator) \
+    c_defer::frame_mgr<stack_size> __defer_mgr(closure_allocator)
+
+#define defer_arg(arg_pos) arg ## arg_pos
+
+/// register a statement, outer vars are accessed by-ref: only vars declared before `defer_init`, see above
+#define defer(code) \
+    __defer_mgr.push_ref([&]() noexcept { code; })
+
+#define defer_hot(code) defer(code)
+
+/// capture by value, like c_defer.h. the body sees the captured values only (and globals),
+/// other locals may be destroyed when it runs, see `defer_init`
+#define defer1_named(closure_var1, cap_val1, code) \
+    __defer_mgr.push([closure_var1 = (cap_val1)]() mutable noexcept { code; })
+#define defer1(cap_var1, code) defer1_named(cap_var1, cap_var1, code)
+#define defer1_ex(cap_val1, code) defer1_named(arg0, cap_val1, code)
+
+#define defer2_named(closure_var1, cap_val1, closure_var2, cap_val2, code) \
+    __defer_mgr.push([closure_var1 = (cap_val1), closure_var2 = (cap_val2)]() mutable noexcept { code; })
+#define defer2(cap_var1, cap_var2, code) defer2_named(cap_var1, cap_var1, cap_var2, cap_var2, code)
+#define defer2_ex(cap_val1, cap_val2, code) defer2_named(arg0, cap_val1, arg1, cap_val2, code)
+
+#define defer3_named(closure_var1, cap_val1, closure_var2, cap_val2, closure_var3, cap_val3, code) \
+    __defer_mgr.push([closure_var1 = (cap_val1), closure_var2 = (cap_val2), \
+        closure_var3 = (cap_val3)]() mutable noexcept { code; })
+#define defer3(cap_var1, cap_var2, cap_var3, code) \
+    defer3_named(cap_var1, cap_var1, cap_var2, cap_var2, cap_var3, cap_var3, code)
+#define defer3_ex(cap_val1, cap_val2, cap_val3, code) \
+    defer3_named(arg0, cap_val1, arg1, cap_val2, arg2, cap_val3, code)
+
+#define defer4_named(closure_var1, cap_val1, closure_var2, cap_val2, closure_var3, cap_val3, closure_var4, cap_val4, code) \
+    __defer_mgr.push([closure_var1 = (cap_val1), closure_var2 = (cap_val2), \
+        closure_var3 = (cap_val3), closure_var4 = (cap_val4)]() mutable noexcept { code; })
+#define defer4(cap_var1, cap_var2, cap_var3, cap_var4, code) \
+    defer4_named(cap_var1, cap_var1, cap_var2, cap_var2, cap_var3, cap_var3, cap_var4, cap_var4, code)
+#define defer4_ex(cap_val1, cap_val2, cap_val3, cap_val4, code) \
+    defer4_named(arg0, cap_val1, arg1, cap_val2, arg2, cap_val3, arg3, cap_val4, code)
+
+/// capture a move-only value (eg: std::unique_ptr) by moving it into the closure
+#define defer_move1(cap_var1, code) defer1_named(cap_var1, std::move(cap_var1), code)
+
+#define defer_each(array, count, fn) \
+    __defer_mgr.push([__a = &(array)[0], __n = (std::size_t)(count)]() noexcept { \
+        std::size_t __i = __n; \
+        while (__i -- > 0) { \
+            fn(__a[__i]); \
+        } \
+    })
+
+#define defer_range(begin, end, fn) \
+    __defer_mgr.push([__b = (begin), __e = (end)]() noexcept { \
+        auto __p = __e; \
+        while (__p != __b) { \
+            fn(*-- __p); \
+        } \
+    })
+
+#define defer_unref(p, counter_field, destroy_fn) \
+([&]() noexcept { \
+    auto __unref_obj = (p); \
+    defer_unref_head_t* __unref = __defer_unref_find(&__defer_mgr.base, (void*)__unref_obj); \
+    if (__unref) { \
+        __unref->pending ++; \
+    } else { \
+        __unref = __defer_unref_new(&__defer_mgr.base, (void*)__unref_obj, \
+            [](defer_unref_head_t* __u) noexcept { \
+                auto __obj = static_cast<decltype(__unref_obj)>(__u->obj); \
+                if (__atomic_sub_fetch(&__obj->counter_field, __u->pending, __ATOMIC_ACQ_REL) == 0) { \
+                    destroy_fn(__obj); \
+                } \
+            }); \
+    } \
+    return __unref ? 1: 0; \
+}())
+
+// -----------------------------------------------------------------------------
+
+#define scope_arg(arg_pos) arg ## arg_pos
+
+#define scope_exit(code) \
+    auto __CONCAT_EX(__scope_closure, __LINE__) = \
+        c_defer::make_scope_guard([&]() noexcept { code; })
+
+#define scope_exit_hot(code) scope_exit(code)
+
+#define scope_exit1_named(var1, val1, code) \
+    auto __CONCAT_EX(__scope_closure, __LINE__) = \
+        c_defer::make_scope_guard([&, var1 = (val1)]() mutable noexcept { code; })
+#define scope_exit1(var1, code) scope_exit1_named(var1, var1, code)
+#define scope_exit1_ex(val1, code) scope_exit1_named(arg0, val1, code)
+
+#define scope_exit2_named(var1, val1, var2, val2, code) \
+    auto __CONCAT_EX(__scope_closure, __LINE__) = \
+        c_defer::make_scope_guard([&, var1 = (val1), var2 = (val2)]() mutable noexcept { code; })
+#define scope_exit2(var1, var2, code) scope_exit2_named(var1, var1, var2, var2, code)
+#define scope_exit2_ex(val1, val2, code) scope_exit2_named(arg0, val1, arg1, val2, code)
+
+#define scope_exit3_named(var1, val1, var2, val2, var3, val3, code) \
+    auto __CONCAT_EX(__scope_closure, __LINE__) = \
+        c_defer::make_scope_guard([&, var1 = (val1), var2 = (val2), var3 = (val3)]() mutable noexcept { code; })
+#define scope_exit3(var1, var2, var3, code) scope_exit3_named(var1, var1, var2, var2, var3, var3, code)
+#define scope_exit3_ex(val1, val2, val3, code) scope_exit3_named(arg0, val1, arg1, val2, arg2, val3, code)
+
+#define scope_exit4_named(var1, val1, var2, val2, var3, val3, var4, val4, code) \
+    auto __CONCAT_EX(__scope_closure, __LINE__) = \
+        c_defer::make_scope_guard([&, var1 = (val1), var2 = (val2), var3 = (val3), \
+            var4 = (val4)]() mutable noexcept { code; })
+#define scope_exit4(var1, var2, var3, var4, code) \
+    scope_exit4_named(var1, var1, var2, var2, var3, var3, var4, var4, code)
+#define scope_exit4_ex(val1, val2, val3, val4, code) \
+    scope_exit4_named(arg0, val1, arg1, val2, arg2, val3, arg3, val4, code)
+
+// ========================[ coroutine-frame defer ]============================
+
+/// enable defer scopes of C++20 coroutines:
+/// the closure manager lives in the coroutine frame (promise), closures are called when the frame is
+/// destroyed, on completion or cancellation. frames are cached per-thread by the promise allocator,
+/// so a suspended coroutine holds no heap memory except its frame.
+#if 0
+    #define ENABLE_DEFER_COROUTINE
+#endif
+
+#ifdef ENABLE_DEFER_COROUTINE
+
+#include <coroutine>
+
+/// max count of free coroutine frames cached per-thread
+#ifndef DEFER_CORO_FRAME_POOL_MAX
+    #define DEFER_CORO_FRAME_POOL_MAX 64
+#endif
+
+namespace c_defer {
+
+/// @brief closure manager bound by `co_defer_init()`, defer macros work with it
+struct mgr_ref {
+    defer_closure_mgr_t& base;
+
+    template <class F>
+    bool push(F&& f) noexcept {
+        return c_defer::push(&base, std::forward<F>(f));
+    }
+
+    /// @brief `defer` is rejected in coroutines: all locals are destroyed before the frame's closures run
+    template <class F>
+    bool push_ref(F&&) noexcept {
+        static_assert(sizeof(F) == 0,
+            "`defer` accesses locals by-ref, they are destroyed before closures of a coroutine frame run: "
+            "capture values by `defer1`...`defer4`, `defer_move1`");
+        return false;
+    }
+};
+
+/// @brief per-thread cache of coroutine frames, one free list per power-of-two size class, newest first
+struct frame_cache {
+    struct block {
+        block*      next;
+        std::size_t cap; // bytes after the header
+    };
+    static_assert(sizeof(block) % __STDCPP_DEFAULT_NEW_ALIGNMENT__ == 0, "frame header breaks alignment");
+
+    /// classes are 64 bytes << [0, classes), bigger frames are not cached
+    static constexpr int classes = 16;
+
+    block* heads[classes] = {};
+    int    count = 0;
+
+    ~frame_cache() {
+        for (block*& head : heads) {
+            while (head) {
+                block* b = head;
+                head = b->next;
+                ::operator delete(b);
+            }
+        }
+    }
+
+    static frame_cache& local() noexcept {
+        static thread_local frame_cache cache;
+        return cache;
+    }
+
+    /// @return class of @size, `classes` if too big
+    static int size_class(std::size_t size) noexcept {
+        int c = 0;
+        while (c < classes && (std::size_t(64) << c) < size) {
+            c ++;
+        }
+        return c;
+    }
+
+    void* alloc(std::size_t size) {
+        int    c = size_class(size);
+        block* b = c < classes ? heads[c] : nullptr;
+        if (b) {
+            heads[c] = b->next;
+            count --;
+        } else {
+            std::size_t cap = c < classes ? std::size_t(64) << c : size;
+            b = static_cast<block*>(::operator new(sizeof(block) + cap));
+            b->cap = cap;
+        }
+        return b + 1;
+    }
+
+    void release(void* p) noexcept {
+        block* b = static_cast<block*>(p) - 1;
+        int    c = size_class(b->cap);
+        if (c < classes && count < DEFER_CORO_FRAME_POOL_MAX) {
+            b->next = heads[c];
+            heads[c] = b;
+            count ++;
+        } else {
+            ::operator delete(b);
+        }
+    }
+};
+
+///
+/// @brief base of promise type, puts a closure manager with @N bytes of builtin buffer into the coroutine frame.
+///        closures are called when the promise is destroyed, i.e. the frame is destroyed:
+///        after `final_suspend`, or by `handle.destroy()` while suspended (cancellation).
+///        locals of coroutine body are gone by then, so closures must capture values (defer1, defer_move1...),
+///        `defer` (by-ref) fails to compile after `co_defer_init()`.
+///
+/// example:
+/// struct task {
+///     struct promise_type: c_defer::coro_defer<512> { ... };
+/// };
+///
+template <int N>
+struct coro_defer {
+    frame_mgr<N> defer_frame_mgr;
+
+    static void* operator new(std::size_t size) {
+        return frame_cache::local().alloc(size);
+    }
+
+    static void operator delete(void* p) noexcept {
+        frame_cache::local().release(p);
+    }
+};
+
+/// @brief awaitable of `co_defer_init()`, never suspends
+struct defer_scope {
+    defer_closure_mgr_t* mgr = nullptr;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    template <class P>
+    bool await_suspend(std::coroutine_handle<P> h) noexcept {
+        mgr = &h.promise().defer_frame_mgr.base;
+        return false;
+    }
+
+    mgr_ref await_resume() const noexcept {
+        return { *mgr };
+    }
+};
+
+} // namespace c_defer
+
+///
+/// init defer in a coroutine whose promise type derives from `c_defer::coro_defer<N>`,
+/// then `defer1`...`defer4`, `defer_move1`, `defer_alloc`, `defer_mgr()`... register into the manager in coroutine frame.
+/// `defer` is rejected at compile time: closures run when the frame is destroyed, after all locals.
+///
+/// example:
+/// task echo(int fd) {
+///     co_defer_init();
+///     char* buf = (char*)defer_alloc(4096, 0);
+///     defer1(fd, close(fd));
+///     ssize_t n = co_await async_read(fd, buf, 4096); // closures stay in frame while suspended
+///     ...
+/// }
+///
+#define co_defer_init() \
+    c_defer::mgr_ref __defer_mgr = co_await c_defer::defer_scope{}
+
+#endif // ENABLE_DEFER_COROUTINE
+
+#endif
@@ -15,11 +15,85 @@
 /// to escape some gcc's marco expanding rule
 #define __CONCAT_X(a, ...) a ## __VA_ARGS__
 
+/// same as __CONCAT_X, but expand macro args first
+#define __CONCAT_EX(a, ...) __CONCAT_X(a, __VA_ARGS__)
+
+/// enable hot/cold splitting, same switch as c_defer.h
+/// bodies of scope closures are emitted as `cold` (.text.unlikely), keep them out of hot text.
+/// use `scope_exit_hot()` for cleanups that run on every call.
+#if 0
+    #define ENABLE_DEFER_COLD_CLEANUP
+#endif
+
+#ifdef ENABLE_DEFER_COLD_CLEANUP
+    #define __SCOPE_COLD_ATTR __attribute__((cold, noinline))
+#else
+    #define __SCOPE_COLD_ATTR
+#endif
+
+/// closure backend, selected by compiler, same as c_defer.h:
+/// gcc: nested functions; clang: blocks, build with `-fblocks` and link with `-lBlocksRuntime`.
+/// !!! with blocks, outer local vars used in closure body are captured by value when registering,
+/// and are read-only in it: this differs from gcc. declare them with `defer_byref` to access them
+/// by-ref as gcc does, `DEFER_BYREF_CAPTURE` tells which semantics is used.
+#if defined(__clang__) && !defined(__cplusplus)
+    #ifndef __BLOCKS__
+        #error "c_scopeguard.h needs blocks on clang, build with -fblocks"
+    #endif
+    #define __SCOPE_BLOCKS
+#endif
+
+#ifndef defer_byref
+    #if defined(__BLOCKS__)
+        #define defer_byref __block
+        #define DEFER_BYREF_CAPTURE 0 // outer vars are captured by value, unless declared `defer_byref`
+    #else
+        #define defer_byref
+        #define DEFER_BYREF_CAPTURE 1 // outer vars are accessed by-ref
+    #endif
+#endif
+
 /// @brief closure obj's common head for scope-closure
 typedef struct _scope_closure_head {
     void (* callback)(struct _scope_closure_head* self);
 } scope_closure_head_t;
 
+#ifdef __SCOPE_BLOCKS
+
+/// with blocks, head of scope-closure is the block, it lives as long as the scope
+static inline void __on_scope_closure_release(void* pobj) {
+    void (^ callback)(void* self) = *(void (^ *)(void*))pobj;
+    callback(pobj);
+}
+
+#define gen_scope_closure_decl() \
+    __attribute__((cleanup(__on_scope_closure_release))) \
+    struct { \
+        void (^ callback)(void* self)
+
+#define gen_scope_closure_field_decl(var_name, cap_val) \
+        typeof(cap_val) var_name
+
+#define gen_scope_closure_cb_field_init_part1(var_id) \
+    } __CONCAT_X(__scope_closure , var_id ) = { \
+        (void (^)(void*)) ^(typeof( __CONCAT_X( __scope_closure , var_id))* __curr_closure) {
+
+/// block literals take no attributes, hot and cold variants are the same
+#define gen_scope_closure_cb_field_init_part1_hot(var_id) \
+    gen_scope_closure_cb_field_init_part1(var_id)
+
+#define gen_scope_closure_cb_field_init_part2_hot(body) \
+    gen_scope_closure_cb_field_init_part2(body)
+
+#define gen_scope_closure_local_var(var_name) \
+                typeof(__curr_closure->var_name) var_name = __curr_closure->var_name
+
+#define gen_scope_closure_cb_field_init_part2(body) \
+                body ; \
+            }
+
+#else // gcc nested functions
+
 static inline void __on_scope_closure_release(void* pobj) {
     scope_closure_head_t* closure = (scope_closure_head_t*)pobj;
     closure->callback(closure);
@@ -36,7 +110,19 @@ static inline void __on_scope_closure_release(void* pobj) {
 #define gen_scope_closure_cb_field_init_part1(var_id) \
     } __CONCAT_X(__scope_closure , var_id ) = { \
         (void(*)(void*)) ({ \
-            void __fn(typeof( __CONCAT_X( __scope_closure , var_id))* __curr_closure) {
+            __SCOPE_COLD_ATTR void __fn(typeof( __CONCAT_X( __scope_closure , var_id))* __curr_closure) {
+
+/// hot variant of part1/part2, closure body is never `cold`
+#define gen_scope_closure_cb_field_init_part1_hot(var_id) \
+    } __CONCAT_X(__scope_closure , var_id ) = { \
+        (void(*)(void*)) ({ \
+            void __fn_hot(typeof( __CONCAT_X( __scope_closure , var_id))* __curr_closure) {
+
+#define gen_scope_closure_cb_field_init_part2_hot(body) \
+                body ; \
+            }; \
+            __fn_hot; \
+        })
 
 #define gen_scope_closure_local_var(var_name) \
                 typeof(__curr_closure->var_name) var_name = __curr_closure->var_name
@@ -47,6 +133,8 @@ static inline void __on_scope_closure_release(void* pobj) {
             __fn; \
         })
 
+#endif // __SCOPE_BLOCKS
+
 #define gen_scope_closure_field_init(a_field) \
         a_field
 
@@ -64,6 +152,13 @@ static inline void __on_scope_closure_release(void* pobj) {
     gen_scope_closure_cb_field_init_part2(code) \
     gen_scope_closure_end();
 
+/// @brief same as `scope_exit`, but the closure body always stays in hot text
+#define scope_exit_hot(code) \
+    gen_scope_closure_decl(); \
+    gen_scope_closure_cb_field_init_part1_hot(__LINE__) \
+    gen_scope_closure_cb_field_init_part2_hot(code) \
+    gen_scope_closure_end();
+
 /// @brief capture the value of val1, execute code when exiting the scope
 #define scope_exit1_ex(val1, code) \
     gen_scope_closure_decl(); \
@@ -182,6 +277,930 @@ static inline void __on_scope_closure_release(void* pobj) {
 #define scope_exit4(var1, var2, var3, var4, code) \
     scope_exit4_named(var1, var1, var2, var2, var3, var3, var4, var4, code)
 
+// ==========================[ ScopeTasks library]=============================
+
+/// enable structured fork-join: `scope_tasks(pool) { scope_spawn(fn, args...); }`
+/// tasks run on a work-stealing thread pool, all of them are joined when exiting the scope.
+/// link with -pthread
+#if 0
+    #define ENABLE_SCOPE_TASKS
+#endif
+
+#ifdef ENABLE_SCOPE_TASKS
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct _scope_task_group;
+
+/// @brief task closure's common head, captured values follow it (same as scope closure)
+typedef struct _scope_task {
+    void (* callback)(struct _scope_task* self);
+    struct _scope_task*       prev;
+    struct _scope_task*       next;
+    struct _scope_task_group* group;
+} scope_task_t;
+
+/// @brief task deque of a worker
+/// owner pushes and pops at head (LIFO), thieves steal from tail (FIFO)
+typedef struct _scope_worker {
+    pthread_mutex_t      lock;
+    scope_task_t*        head;
+    scope_task_t*        tail;
+    pthread_t            tid;
+    struct _scope_pool*  pool;
+    int                  id;
+} scope_worker_t;
+
+/// @brief work-stealing thread pool
+typedef struct _scope_pool {
+    int              nworkers;
+    scope_worker_t*  workers;
+    pthread_mutex_t  lock;     // guard sleeping of workers and joiners
+    pthread_cond_t   cond;
+    int              queued;   // tasks in all deques
+    int              sleepers;
+    int              stop;
+    unsigned         next;     // round-robin target for non-worker threads
+} scope_pool_t;
+
+/// @brief tasks spawned in one `scope_tasks` block
+typedef struct _scope_task_group {
+    scope_pool_t*    pool;
+    int              pending;
+} scope_task_group_t;
+
+/// @return worker of current thread, NULL for non-worker thread
+static inline scope_worker_t** __scope_worker_self(void) {
+    static __thread scope_worker_t* self;
+    return &self;
+}
+
+static inline void __scope_worker_push(scope_worker_t* w, scope_task_t* t) {
+    pthread_mutex_lock(&w->lock);
+    t->prev = NULL;
+    t->next = w->head;
+    if (w->head) {
+        w->head->prev = t;
+    } else {
+        w->tail = t;
+    }
+    w->head = t;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/// @param steal 0: pop head by owner, 1: steal tail
+static inline scope_task_t* __scope_worker_pop(scope_worker_t* w, int steal) {
+    scope_task_t* t;
+    pthread_mutex_lock(&w->lock);
+    if (steal) {
+        t = w->tail;
+        if (t) {
+            w->tail = t->prev;
+            if (w->tail) { w->tail->next = NULL; } else { w->head = NULL; }
+        }
+    } else {
+        t = w->head;
+        if (t) {
+            w->head = t->next;
+            if (w->head) { w->head->prev = NULL; } else { w->tail = NULL; }
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return t;
+}
+
+/// @brief take a task: own deque first, then steal from others
+static inline scope_task_t* __scope_pool_take(scope_pool_t* pool) {
+    scope_worker_t* self = *__scope_worker_self();
+    scope_task_t*   t = NULL;
+    int i, start;
+
+    if (!__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST)) {
+        return NULL;
+    }
+    if (self && self->pool == pool) {
+        t = __scope_worker_pop(self, 0);
+        start = self->id + 1;
+    } else {
+        self = NULL;
+        start = 0;
+    }
+    for (i = 0; !t && i < pool->nworkers; i ++) {
+        scope_worker_t* w = &pool->workers[(start + i) % pool->nworkers];
+        if (w != self) {
+            t = __scope_worker_pop(w, 1);
+        }
+    }
+    if (t) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return t;
+}
+
+/// @brief sleep until a task is queued, or *@pending reaches zero, or pool is stopping
+static inline void __scope_pool_wait(scope_pool_t* pool, int* pending) {
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) && !pool->stop
+        && !(pending && !__atomic_load_n(pending, __ATOMIC_SEQ_CST))) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline void __scope_pool_wake(scope_pool_t* pool, int all) {
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->lock);
+        if (all) {
+            pthread_cond_broadcast(&pool->cond);
+        } else {
+            pthread_cond_signal(&pool->cond);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static inline void __scope_task_run(scope_task_t* t) {
+    scope_task_group_t* g = t->group;
+    scope_pool_t* pool = g->pool;
+    t->callback(t);
+    free(t);
+    // group may be gone right after the last task is done, only touch pool then
+    if (__atomic_sub_fetch(&g->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        __scope_pool_wake(pool, 1);
+    }
+}
+
+static inline void* __scope_worker_main(void* arg) {
+    scope_worker_t* self = (scope_worker_t*)arg;
+    scope_pool_t*   pool = self->pool;
+    *__scope_worker_self() = self;
+    while (!__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST)) {
+        scope_task_t* t = __scope_pool_take(pool);
+        if (t) {
+            __scope_task_run(t);
+        } else {
+            __scope_pool_wait(pool, NULL);
+        }
+    }
+    return NULL;
+}
+
+/// @brief create a work-stealing thread pool
+/// @param nthreads count of worker threads, <= 0 means count of online cpus
+/// @return ptr to pool, NULL means failed
+static inline scope_pool_t* scope_pool_create(int nthreads) {
+    scope_pool_t* pool;
+    int i;
+    if (nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+    pool = (scope_pool_t*)calloc(1, sizeof(scope_pool_t) + sizeof(scope_worker_t) * nthreads);
+    if (!pool) {
+        return NULL;
+    }
+    pool->workers = (scope_worker_t*)(pool + 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (i = 0; i < nthreads; i ++) {
+        scope_worker_t* w = &pool->workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->pool = pool;
+        w->id = i;
+    }
+    for (i = 0; i < nthreads; i ++) {
+        if (pthread_create(&pool->workers[i].tid, NULL, __scope_worker_main, &pool->workers[i]) != 0) {
+            break;
+        }
+        pool->nworkers ++;
+    }
+    if (!pool->nworkers) {
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/// @brief stop and free the pool, all `scope_tasks` blocks using it must be finished
+static inline void scope_pool_destroy(scope_pool_t* pool) {
+    int i;
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nworkers; i ++) {
+        pthread_join(pool->workers[i].tid, NULL);
+    }
+    for (i = 0; i < pool->nworkers; i ++) {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static inline scope_task_t* __scope_task_new(scope_task_group_t* g, int size) {
+    scope_task_t* t = (scope_task_t*)malloc(size);
+    if (t) {
+        t->group = g;
+    }
+    return t;
+}
+
+static inline void __scope_task_submit(scope_task_t* t) {
+    scope_pool_t*   pool = t->group->pool;
+    scope_worker_t* self = *__scope_worker_self();
+    __atomic_add_fetch(&t->group->pending, 1, __ATOMIC_SEQ_CST);
+    if (!self || self->pool != pool) {
+        self = &pool->workers[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->nworkers];
+    }
+    __scope_worker_push(self, t);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    __scope_pool_wake(pool, 0);
+}
+
+/// @brief cleanup of `scope_tasks`: wait all tasks of group, run queued tasks while waiting
+static inline void __scope_task_group_join(void* pgroup) {
+    scope_task_group_t* g = (scope_task_group_t*)pgroup;
+    while (__atomic_load_n(&g->pending, __ATOMIC_SEQ_CST)) {
+        scope_task_t* t = __scope_pool_take(g->pool);
+        if (t) {
+            __scope_task_run(t);
+        } else {
+            __scope_pool_wait(g->pool, &g->pending);
+        }
+    }
+}
+
+#ifdef __SCOPE_BLOCKS
+
+/// @brief layout of a block literal, see clang Block-ABI
+typedef struct _scope_block_literal {
+    void* isa;
+    int   flags;
+    int   reserved;
+    void (*invoke)(void* self, void* arg);
+    struct {
+        unsigned long reserved;
+        unsigned long size;
+    }* descriptor;
+} __scope_block_literal_t;
+
+/// @brief task head with blocks, the block literal is copied to @block_offset
+typedef struct _scope_block_task {
+    scope_task_t base;
+    int          block_offset;
+} __scope_block_task_t;
+
+static inline void __scope_task_block_call(scope_task_t* t) {
+    __scope_block_literal_t* blk = (__scope_block_literal_t*)((char*)t + ((__scope_block_task_t*)t)->block_offset);
+    blk->invoke(blk, t);
+}
+
+/// @brief alloc a task, copy captured values from @tmp and the block literal after them (byte-wise, no `Block_copy`)
+static inline scope_task_t* __scope_task_block_new(scope_task_group_t* g, scope_task_t* tmp, int size, void* blk) {
+    int off = (size + (int)sizeof(void*) - 1) & ~((int)sizeof(void*) - 1);
+    int bsize = (int)((__scope_block_literal_t*)blk)->descriptor->size;
+    scope_task_t* t = __scope_task_new(g, off + bsize);
+    if (t) {
+        memcpy(t + 1, tmp + 1, size - sizeof(scope_task_t));
+        t->callback = __scope_task_block_call;
+        ((__scope_block_task_t*)t)->block_offset = off;
+        memcpy((char*)t + off, blk, bsize);
+    }
+    return t;
+}
+
+#define gen_scope_task_decl() \
+    struct { \
+        scope_task_t base; \
+        int __block_offset
+
+/// captured values are saved in a task on stack, then copied with the block
+#define gen_scope_task_init() \
+    } __task_tmp, * __curr_task = &__task_tmp; \
+    {
+
+#define gen_scope_task_field_init(var_name, val) \
+        __curr_task->var_name = val
+
+#define gen_scope_task_cb_part1() \
+        __curr_task = (typeof(__curr_task)) __scope_task_block_new(&__scope_task_group, \
+            &__task_tmp.base, sizeof(__task_tmp), (void*) ^(typeof(__curr_task) __curr_closure) {
+
+#define gen_scope_task_cb_part2(code) \
+                code ; \
+            }); \
+        if (__curr_task) { \
+            __scope_task_submit(&__curr_task->base); \
+        } \
+    } \
+    __curr_task ? 1 : 0
+
+#else // gcc nested functions
+
+#define gen_scope_task_decl() \
+    struct { \
+        scope_task_t base
+
+#define gen_scope_task_init() \
+    } * __curr_task = (typeof(__curr_task)) __scope_task_new(&__scope_task_group, sizeof(*__curr_task)); \
+    if (__curr_task) {
+
+#define gen_scope_task_field_init(var_name, val) \
+        __curr_task->var_name = val
+
+#define gen_scope_task_cb_part1() \
+        __curr_task->base.callback = (void (*)(scope_task_t*)) ({ \
+            void __task_fn(typeof(__curr_task) __curr_closure) {
+
+#define gen_scope_task_cb_part2(code) \
+                code ; \
+            }; \
+            __task_fn; \
+        }); \
+        __scope_task_submit(&__curr_task->base); \
+    } \
+    __curr_task ? 1 : 0
+
+#endif // __SCOPE_BLOCKS
+
+// -----------------------------------------------------------------------------
+
+///
+/// @brief a block whose spawned tasks are all joined when exiting it (fall through, break or return).
+///        no task can outlive the stack data it captured.
+///        the joining thread runs queued tasks while waiting.
+/// @param pool `scope_pool_t*` from `scope_pool_create`
+///
+/// example:
+/// scope_tasks(pool) {
+///     for (i = 0; i < n; i ++) {
+///         scope_spawn(sum_part, arr, i * step, (i + 1) * step, &parts[i]);
+///     }
+/// } // all sum_part() are done here
+///
+#define scope_tasks(pool) \
+    for (int __scope_tasks_once = 1; __scope_tasks_once; __scope_tasks_once = 0) \
+        for (__attribute__((cleanup(__scope_task_group_join))) \
+            scope_task_group_t __scope_task_group = { (pool), 0 }; \
+            __scope_tasks_once; __scope_tasks_once = 0)
+
+/// @brief run `code` as a task of current `scope_tasks` block
+#define scope_spawn_code(code) \
+({ \
+    gen_scope_task_decl(); \
+    gen_scope_task_init() \
+    gen_scope_task_cb_part1() \
+    gen_scope_task_cb_part2(code); \
+})
+
+#define __scope_spawn_0(fn) \
+    scope_spawn_code(fn())
+
+#define __scope_spawn_1(fn, val1) \
+({ \
+    gen_scope_task_decl(); \
+    gen_scope_closure_field_decl(arg0, val1); \
+    gen_scope_task_init() \
+    gen_scope_task_field_init(arg0, val1); \
+    gen_scope_task_cb_part1() \
+    gen_scope_task_cb_part2(fn(scope_arg(0))); \
+})
+
+#define __scope_spawn_2(fn, val1, val2) \
+({ \
+    gen_scope_task_decl(); \
+    gen_scope_closure_field_decl(arg0, val1); \
+    gen_scope_closure_field_decl(arg1, val2); \
+    gen_scope_task_init() \
+    gen_scope_task_field_init(arg0, val1); \
+    gen_scope_task_field_init(arg1, val2); \
+    gen_scope_task_cb_part1() \
+    gen_scope_task_cb_part2(fn(scope_arg(0), scope_arg(1))); \
+})
+
+#define __scope_spawn_3(fn, val1, val2, val3) \
+({ \
+    gen_scope_task_decl(); \
+    gen_scope_closure_field_decl(arg0, val1); \
+    gen_scope_closure_field_decl(arg1, val2); \
+    gen_scope_closure_field_decl(arg2, val3); \
+    gen_scope_task_init() \
+    gen_scope_task_field_init(arg0, val1); \
+    gen_scope_task_field_init(arg1, val2); \
+    gen_scope_task_field_init(arg2, val3); \
+    gen_scope_task_cb_part1() \
+    gen_scope_task_cb_part2(fn(scope_arg(0), scope_arg(1), scope_arg(2))); \
+})
+
+#define __scope_spawn_4(fn, val1, val2, val3, val4) \
+({ \
+    gen_scope_task_decl(); \
+    gen_scope_closure_field_decl(arg0, val1); \
+    gen_scope_closure_field_decl(arg1, val2); \
+    gen_scope_closure_field_decl(arg2, val3); \
+    gen_scope_closure_field_decl(arg3, val4); \
+    gen_scope_task_init() \
+    gen_scope_task_field_init(arg0, val1); \
+    gen_scope_task_field_init(arg1, val2); \
+    gen_scope_task_field_init(arg2, val3); \
+    gen_scope_task_field_init(arg3, val4); \
+    gen_scope_task_cb_part1() \
+    gen_scope_task_cb_part2(fn(scope_arg(0), scope_arg(1), scope_arg(2), scope_arg(3))); \
+})
+
+#define __scope_spawn_nargs(...) __scope_spawn_nargs_(__VA_ARGS__, 4, 3, 2, 1, 0)
+#define __scope_spawn_nargs_(_fn, _1, _2, _3, _4, N, ...) N
+
+///
+/// @brief call `fn(args...)` as a task of current `scope_tasks` block, up to 4 args.
+///        args are captured by value when spawning, same as `scope_exitN`.
+/// @return boolean, 0 means memory failed! 1 means ok
+///
+#define scope_spawn(...) \
+    __CONCAT_EX(__scope_spawn_, __scope_spawn_nargs(__VA_ARGS__))(__VA_ARGS__)
+
+#endif // ENABLE_SCOPE_TASKS
+
+// ==========================[ ScopeFile library]==============================
+
+/// enable scoped file mapping: `scope_mmap_file(path, &view)`,
+/// the file is unmapped and closed when exiting the scope.
+#if 0
+    #define ENABLE_SCOPE_FILE
+#endif
+
+#ifdef ENABLE_SCOPE_FILE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// hints of `scope_mmap_file_ex`/`scope_mmap_rw_ex`
+#define SCOPE_MMAP_POPULATE   (1<<0) // pre-fault all pages (MAP_POPULATE)
+#define SCOPE_MMAP_SEQUENTIAL (1<<1) // madvise(MADV_SEQUENTIAL), aggressive read-ahead
+#define SCOPE_MMAP_HUGEPAGE   (1<<2) // madvise(MADV_HUGEPAGE), if supported by the filesystem
+
+/// @brief view of a mapped file
+typedef struct _scope_mmap_view {
+    void*   data;   // NULL if failed, or file is empty
+    size_t  size;
+    int     fd;     // -1 if failed
+    int     error;  // 0 or errno of the failed call
+} scope_mmap_view_t;
+
+/// @brief scope guard of a mapped file, released by `__scope_mmap_release` directly
+/// (not a scope-closure: with blocks the head of a scope-closure must be a block)
+typedef struct _scope_mmap_closure {
+    scope_mmap_view_t view;
+} scope_mmap_closure_t;
+
+static inline scope_mmap_view_t __scope_mmap_open(const char* path, int writable, int hints) {
+    scope_mmap_view_t v = { NULL, 0, -1, 0 };
+    struct stat st;
+    int flags = writable ? MAP_SHARED : MAP_PRIVATE;
+
+    v.fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (v.fd < 0 || fstat(v.fd, &st) != 0) {
+        v.error = errno;
+        return v;
+    }
+    if (st.st_size == 0) {
+        return v; // nothing to map
+    }
+#ifdef MAP_POPULATE
+    if (hints & SCOPE_MMAP_POPULATE) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    v.data = mmap(NULL, (size_t)st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, flags, v.fd, 0);
+    if (v.data == MAP_FAILED) {
+        v.data = NULL;
+        v.error = errno;
+        return v;
+    }
+    v.size = (size_t)st.st_size;
+
+    if (hints & SCOPE_MMAP_SEQUENTIAL) {
+        madvise(v.data, v.size, MADV_SEQUENTIAL);
+    }
+#ifdef MADV_HUGEPAGE
+    if (hints & SCOPE_MMAP_HUGEPAGE) {
+        madvise(v.data, v.size, MADV_HUGEPAGE);
+    }
+#endif
+    return v;
+}
+
+static inline void __scope_mmap_release(scope_mmap_closure_t* self) {
+    scope_mmap_view_t* v = &self->view;
+    if (v->data) {
+        munmap(v->data, v->size);
+    }
+    if (v->fd >= 0) {
+        close(v->fd);
+    }
+}
+
+#define gen_scope_mmap(pview, path, writable, hints) \
+    __attribute__((cleanup(__scope_mmap_release))) \
+    scope_mmap_closure_t __CONCAT_EX(__scope_mmap, __LINE__) = { \
+        __scope_mmap_open(path, writable, hints) \
+    }; \
+    *(pview) = __CONCAT_EX(__scope_mmap, __LINE__).view
+
+// -----------------------------------------------------------------------------
+
+///
+/// @brief map file @path read-only, unmap and close it when exiting the scope.
+///        check `view.error` for failure; an empty file gives `view.data == NULL` and `view.size == 0`.
+/// @param path file path
+/// @param pview `scope_mmap_view_t*` that receives the view
+///
+/// example:
+/// scope_mmap_view_t view;
+/// scope_mmap_file_ex("input.txt", &view, SCOPE_MMAP_SEQUENTIAL);
+/// if (view.error) { return -1; }
+/// fwrite(view.data, 1, view.size, stdout);
+///
+#define scope_mmap_file(path, pview) \
+    gen_scope_mmap(pview, path, 0, 0)
+
+/// @brief same as `scope_mmap_file`, with `SCOPE_MMAP_*` hints
+#define scope_mmap_file_ex(path, pview, hints) \
+    gen_scope_mmap(pview, path, 0, hints)
+
+/// @brief map file @path read-write and shared, changes are written back to the file
+#define scope_mmap_rw(path, pview) \
+    gen_scope_mmap(pview, path, 1, 0)
+
+/// @brief same as `scope_mmap_rw`, with `SCOPE_MMAP_*` hints
+#define scope_mmap_rw_ex(path, pview, hints) \
+    gen_scope_mmap(pview, path, 1, hints)
+
+#endif // ENABLE_SCOPE_FILE
+
+// ==========================[ ScopeLock library]==============================
+
+/// enable lock guards: `scope_lock(m)`, `scope_rdlock(rw)`, `scope_wrlock(rw)`,
+/// the lock is released when exiting the scope, by a direct call to unlock.
+/// link with -pthread
+#if 0
+    #define ENABLE_SCOPE_LOCK
+#endif
+
+/// enable lock profiling: acquire-wait and hold times of each `scope_*lock` site
+/// are recorded in per-thread histograms, dump them by `scope_lock_profile_dump()`
+#if 0
+    #define ENABLE_SCOPE_LOCK_PROFILE
+#endif
+
+#if defined(ENABLE_SCOPE_LOCK_PROFILE) && !defined(ENABLE_SCOPE_LOCK)
+    #define ENABLE_SCOPE_LOCK
+#endif
+
+#ifdef ENABLE_SCOPE_LOCK
+
+#include <pthread.h>
+
+/// @brief a `scope_*lock` call site
+typedef struct _scope_lock_site {
+    const char* file;
+    int         line;
+    const char* expr;
+} scope_lock_site_t;
+
+#ifdef ENABLE_SCOPE_LOCK_PROFILE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// histogram buckets, bucket N counts times in [2^N, 2^(N+1)) ns
+#define SCOPE_LOCK_HIST_BUCKETS 40
+
+/// max sites recorded by each thread, must be power of 2
+#ifndef SCOPE_LOCK_PROFILE_SITES
+    #define SCOPE_LOCK_PROFILE_SITES 128
+#endif
+
+/// @brief stats of one site in one thread, only written by the owner thread
+typedef struct _scope_lock_stat {
+    const scope_lock_site_t* site;
+    uint64_t                 count;
+    uint64_t                 wait_ns;
+    uint64_t                 hold_ns;
+    uint64_t                 wait_hist[SCOPE_LOCK_HIST_BUCKETS];
+    uint64_t                 hold_hist[SCOPE_LOCK_HIST_BUCKETS];
+} scope_lock_stat_t;
+
+/// @brief stats table of one thread, it is kept after the thread exits
+typedef struct _scope_lock_profile {
+    struct _scope_lock_profile* next;
+    uint64_t                    dropped; // samples of sites not fitting in table
+    scope_lock_stat_t           stats[SCOPE_LOCK_PROFILE_SITES];
+} scope_lock_profile_t;
+
+// weak symbols, so all translation units share them
+__attribute__((weak)) scope_lock_profile_t*          __scope_lock_profiles;
+__attribute__((weak)) __thread scope_lock_profile_t* __scope_lock_profile_self;
+
+static inline uint64_t __scope_lock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline int __scope_lock_bucket(uint64_t ns) {
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+    return b < SCOPE_LOCK_HIST_BUCKETS ? b : SCOPE_LOCK_HIST_BUCKETS - 1;
+}
+
+/// @brief single-writer increment, readable by `scope_lock_profile_dump` from other threads
+static inline void __scope_lock_stat_add(uint64_t* v, uint64_t n) {
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline scope_lock_stat_t* __scope_lock_stat_find(const scope_lock_site_t* site) {
+    scope_lock_profile_t* prof = __scope_lock_profile_self;
+    unsigned i, idx;
+    if (!prof) {
+        prof = (scope_lock_profile_t*)calloc(1, sizeof(scope_lock_profile_t));
+        if (!prof) {
+            return NULL;
+        }
+        prof->next = __atomic_load_n(&__scope_lock_profiles, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&__scope_lock_profiles, &prof->next, prof, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        __scope_lock_profile_self = prof;
+    }
+    idx = (unsigned)((uintptr_t)site >> 4);
+    for (i = 0; i < SCOPE_LOCK_PROFILE_SITES; i ++) {
+        scope_lock_stat_t* st = &prof->stats[(idx + i) & (SCOPE_LOCK_PROFILE_SITES - 1)];
+        if (st->site == site) {
+            return st;
+        }
+        if (!st->site) {
+            __atomic_store_n(&st->site, site, __ATOMIC_RELEASE);
+            return st;
+        }
+    }
+    __scope_lock_stat_add(&prof->dropped, 1);
+    return NULL;
+}
+
+static inline void __scope_lock_record(const scope_lock_site_t* site, uint64_t wait_ns, uint64_t hold_ns) {
+    scope_lock_stat_t* st = __scope_lock_stat_find(site);
+    if (st) {
+        __scope_lock_stat_add(&st->count, 1);
+        __scope_lock_stat_add(&st->wait_ns, wait_ns);
+        __scope_lock_stat_add(&st->hold_ns, hold_ns);
+        __scope_lock_stat_add(&st->wait_hist[__scope_lock_bucket(wait_ns)], 1);
+        __scope_lock_stat_add(&st->hold_hist[__scope_lock_bucket(hold_ns)], 1);
+    }
+}
+
+/// @return upper bound (ns) of the bucket holding percentile @pct, 0 for the first bucket (< 2ns)
+static inline uint64_t __scope_lock_hist_pct(const uint64_t* hist, uint64_t count, int pct) {
+    uint64_t need = (count * pct + 99) / 100, seen = 0;
+    int b;
+    for (b = 0; b < SCOPE_LOCK_HIST_BUCKETS; b ++) {
+        seen += hist[b];
+        if (seen >= need) {
+            break;
+        }
+    }
+    return b ? 2ull << b : 0;
+}
+
+///
+/// @brief print stats of all profiled sites, merged over all threads, sorted by total wait time
+/// @param out output stream, eg: stderr
+///
+static inline void scope_lock_profile_dump(FILE* out) {
+    scope_lock_stat_t* merged = NULL;
+    int nmerged = 0, cap = 0, i, j, b;
+    uint64_t dropped = 0;
+    scope_lock_profile_t* prof;
+
+    for (prof = __atomic_load_n(&__scope_lock_profiles, __ATOMIC_ACQUIRE); prof; prof = prof->next) {
+        dropped += __atomic_load_n(&prof->dropped, __ATOMIC_RELAXED);
+        for (i = 0; i < SCOPE_LOCK_PROFILE_SITES; i ++) {
+            const scope_lock_stat_t*  st = &prof->stats[i];
+            const scope_lock_site_t*  site = __atomic_load_n(&st->site, __ATOMIC_ACQUIRE);
+            scope_lock_stat_t* m = NULL;
+            if (!site) {
+                continue;
+            }
+            for (j = 0; j < nmerged; j ++) {
+                if (merged[j].site == site) {
+                    m = &merged[j];
+                    break;
+                }
+            }
+            if (!m) {
+                if (nmerged == cap) {
+                    scope_lock_stat_t* nm;
+                    cap = cap ? cap * 2 : 16;
+                    nm = (scope_lock_stat_t*)realloc(merged, sizeof(scope_lock_stat_t) * cap);
+                    if (!nm) {
+                        free(merged);
+                        return;
+                    }
+                    merged = nm;
+                }
+                m = &merged[nmerged ++];
+                memset(m, 0, sizeof(*m));
+                m->site = site;
+            }
+            m->count   += __atomic_load_n(&st->count, __ATOMIC_RELAXED);
+            m->wait_ns += __atomic_load_n(&st->wait_ns, __ATOMIC_RELAXED);
+            m->hold_ns += __atomic_load_n(&st->hold_ns, __ATOMIC_RELAXED);
+            for (b = 0; b < SCOPE_LOCK_HIST_BUCKETS; b ++) {
+                m->wait_hist[b] += __atomic_load_n(&st->wait_hist[b], __ATOMIC_RELAXED);
+                m->hold_hist[b] += __atomic_load_n(&st->hold_hist[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    // sort by total wait, most contended first
+    for (i = 1; i < nmerged; i ++) {
+        scope_lock_stat_t tmp = merged[i];
+        for (j = i; j > 0 && merged[j - 1].wait_ns < tmp.wait_ns; j --) {
+            merged[j] = merged[j - 1];
+        }
+        merged[j] = tmp;
+    }
+
+    fprintf(out, "%-32s %10s %12s %10s %10s %12s %10s %10s\n",
+        "site", "count", "wait-total", "wait-avg", "wait-p99", "hold-total", "hold-avg", "hold-p99");
+    for (i = 0; i < nmerged; i ++) {
+        const scope_lock_stat_t* m = &merged[i];
+        char where[256];
+        uint64_t n = m->count ? m->count : 1;
+        snprintf(where, sizeof(where), "%s:%d(%s)", m->site->file, m->site->line, m->site->expr);
+        fprintf(out, "%-32s %10llu %10lluns %8lluns %8lluns %10lluns %8lluns %8lluns\n",
+            where, (unsigned long long)m->count,
+            (unsigned long long)m->wait_ns, (unsigned long long)(m->wait_ns / n),
+            (unsigned long long)__scope_lock_hist_pct(m->wait_hist, m->count, 99),
+            (unsigned long long)m->hold_ns, (unsigned long long)(m->hold_ns / n),
+            (unsigned long long)__scope_lock_hist_pct(m->hold_hist, m->count, 99));
+    }
+    if (dropped) {
+        fprintf(out, "*** %llu samples dropped, increase SCOPE_LOCK_PROFILE_SITES\n", (unsigned long long)dropped);
+    }
+    free(merged);
+}
+
+#define __scope_lock_site(lock) \
+    ({ static const scope_lock_site_t __scope_site = { __FILE__, __LINE__, #lock }; &__scope_site; })
+
+/// @brief acquire by @try_fn first, measure waiting only when it fails
+#define __scope_lock_acquire(g, lock_site, lock_fn, try_fn) \
+    do { \
+        uint64_t __t0 = __scope_lock_now_ns(); \
+        g.site = lock_site; \
+        g.wait_ns = 0; \
+        g.t_acquired = __t0; \
+        if (try_fn(g.lock) != 0) { \
+            lock_fn(g.lock); \
+            g.t_acquired = __scope_lock_now_ns(); \
+            g.wait_ns = g.t_acquired - __t0; \
+        } \
+    } while (0)
+
+/// the stats are recorded after unlocking, out of the critical section
+#define __scope_lock_release(g, unlock_fn) \
+    do { \
+        uint64_t __hold = __scope_lock_now_ns() - g->t_acquired; \
+        unlock_fn(g->lock); \
+        __scope_lock_record(g->site, g->wait_ns, __hold); \
+    } while (0)
+
+#else
+
+#define __scope_lock_site(lock) ((const scope_lock_site_t*)0)
+
+#endif // ENABLE_SCOPE_LOCK_PROFILE
+
+/// @brief guard of `scope_lock`
+typedef struct _scope_mutex_guard {
+    pthread_mutex_t*         lock;
+#ifdef ENABLE_SCOPE_LOCK_PROFILE
+    const scope_lock_site_t* site;
+    uint64_t                 t_acquired;
+    uint64_t                 wait_ns;
+#endif
+} scope_mutex_guard_t;
+
+/// @brief guard of `scope_rdlock`/`scope_wrlock`
+typedef struct _scope_rwlock_guard {
+    pthread_rwlock_t*        lock;
+#ifdef ENABLE_SCOPE_LOCK_PROFILE
+    const scope_lock_site_t* site;
+    uint64_t                 t_acquired;
+    uint64_t                 wait_ns;
+#endif
+} scope_rwlock_guard_t;
+
+static inline scope_mutex_guard_t __scope_mutex_lock(pthread_mutex_t* m, const scope_lock_site_t* site) {
+    scope_mutex_guard_t g;
+    g.lock = m;
+#ifdef ENABLE_SCOPE_LOCK_PROFILE
+    __scope_lock_acquire(g, site, pthread_mutex_lock, pthread_mutex_trylock);
+#else
+    (void)site;
+    pthread_mutex_lock(m);
+#endif
+    return g;
+}
+
+static inline void __scope_mutex_unlock(scope_mutex_guard_t* g) {
+#ifdef ENABLE_SCOPE_LOCK_PROFILE
+    __scope_lock_release(g, pthread_mutex_unlock);
+#else
+    pthread_mutex_unlock(g->lock);
+#endif
+}
+
+static inline scope_rwlock_guard_t __scope_rwlock_rdlock(pthread_rwlock_t* rw, const scope_lock_site_t* site) {
+    scope_rwlock_guard_t g;
+    g.lock = rw;
+#ifdef ENABLE_SCOPE_LOCK_PROFILE
+    __scope_lock_acquire(g, site, pthread_rwlock_rdlock, pthread_rwlock_tryrdlock);
+#else
+    (void)site;
+    pthread_rwlock_rdlock(rw);
+#endif
+    return g;
+}
+
+static inline scope_rwlock_guard_t __scope_rwlock_wrlock(pthread_rwlock_t* rw, const scope_lock_site_t* site) {
+    scope_rwlock_guard_t g;
+    g.lock = rw;
+#ifdef ENABLE_SCOPE_LOCK_PROFILE
+    __scope_lock_acquire(g, site, pthread_rwlock_wrlock, pthread_rwlock_trywrlock);
+#else
+    (void)site;
+    pthread_rwlock_wrlock(rw);
+#endif
+    return g;
+}
+
+static inline void __scope_rwlock_unlock(scope_rwlock_guard_t* g) {
+#ifdef ENABLE_SCOPE_LOCK_PROFILE
+    __scope_lock_release(g, pthread_rwlock_unlock);
+#else
+    pthread_rwlock_unlock(g->lock);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+
+///
+/// @brief lock mutex @m, unlock it when exiting the scope.
+///        same as `scope_exit1(m, pthread_mutex_unlock(m))` after locking, without a closure call.
+/// @param m `pthread_mutex_t*`
+///
+/// example:
+/// {
+///     scope_lock(&g_lock);
+///     g_count ++;
+/// } // unlocked here
+///
+#define scope_lock(m) \
+    __attribute__((cleanup(__scope_mutex_unlock))) \
+    scope_mutex_guard_t __CONCAT_EX(__scope_lock, __LINE__) = __scope_mutex_lock(m, __scope_lock_site(m))
+
+/// @brief read-lock rwlock @rw, unlock it when exiting the scope
+#define scope_rdlock(rw) \
+    __attribute__((cleanup(__scope_rwlock_unlock))) \
+    scope_rwlock_guard_t __CONCAT_EX(__scope_lock, __LINE__) = __scope_rwlock_rdlock(rw, __scope_lock_site(rw))
+
+/// @brief write-lock rwlock @rw, unlock it when exiting the scope
+#define scope_wrlock(rw) \
+    __attribute__((cleanup(__scope_rwlock_unlock))) \
+    scope_rwlock_guard_t __CONCAT_EX(__scope_lock, __LINE__) = __scope_rwlock_wrlock(rw, __scope_lock_site(rw))
+
+#endif // ENABLE_SCOPE_LOCK
+
 // =============================================================================
 
 #endif
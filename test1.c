@@ -6,6 +6,10 @@
  * License: MIT
  */
 
+#define ENABLE_SCOPE_TASKS
+#define ENABLE_DEFER_REGISTRY
+#define ENABLE_SCOPE_FILE
+#define ENABLE_SCOPE_LOCK_PROFILE
 
 #include "c_defer.h"
 #include "c_scopeguard.h"
@@ -13,6 +17,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // -----------------------------------------------------------------------------
 
@@ -169,7 +174,7 @@ int test_scopeguard() {
 
 int test_defer() {
 
-    defer_init(1024, NULL);
+    defer_init(2048, NULL);
 
     defer({
         printf("0: defer is called!\n");
@@ -359,6 +364,526 @@ int test_defer() {
     return 0;
 }
 
+/// spill to chunks in a thread, cached chunks are freed when it exits
+static void* defer_alloc_thread_main(void* arg) {
+    defer_init(64, NULL);
+    char* p = defer_alloc(DEFER_ALLOC_CHUNK_SIZE / 2, 0);
+    snprintf(p, 64, "%s", (const char*)arg);
+    printf("defer_alloc: thread [%s] spilled\n", p);
+    return NULL;
+}
+
+int test_defer_alloc() {
+
+    defer_init(512, NULL);
+
+    defer({
+        printf("defer_alloc: closures are called before memory is reclaimed\n");
+    });
+
+    // from builtin buffer
+    char* s1 = defer_alloc(32, 0);
+    strcpy(s1, "defer_alloc from builtin buffer");
+
+    double* d = defer_alloc(sizeof(double) * 4, 64);
+    printf("defer_alloc: aligned-64=%d\n", (int)(((uintptr_t)d & 63) == 0));
+
+    // builtin buffer is full, spill to chunks
+    char* big = defer_alloc(DEFER_ALLOC_CHUNK_SIZE * 2, 0);
+    memset(big, 'x', DEFER_ALLOC_CHUNK_SIZE * 2);
+
+    int i;
+    defer_byref char* last = NULL;
+
+    // access s1 and last by-ref
+    defer({
+        printf("defer_alloc: [%s] [%s]\n", s1, last);
+    });
+
+    for (i = 0; i < 100; i ++) {
+        last = defer_alloc(100, 16);
+        snprintf(last, 100, "spilled buffer %d", i);
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, defer_alloc_thread_main, (void*)"t1");
+    pthread_join(tid, NULL);
+
+    return 0;
+}
+
+static void print_and_free(char* p) {
+    printf("defer_each: free [%s]\n", p);
+    free(p);
+}
+
+int test_defer_each() {
+
+    defer_init(256, NULL);
+
+    // thousands of elements, still one closure
+    int i;
+    char* bufs[4000];
+    for (i = 0; i < 4000; i ++) {
+        bufs[i] = (char*)malloc(16);
+    }
+    defer_each(bufs, 4000, free);
+
+    char* names[3];
+    for (i = 0; i < 3; i ++) {
+        names[i] = (char*)malloc(16);
+        snprintf(names[i], 16, "name-%d", i);
+    }
+    defer_each(names, 3, print_and_free);
+
+    int fds[4] = { 10, 11, 12, 13 };
+    #define print_fd(fd) printf("defer_range: close(%d)\n", fd)
+    defer_range(fds, fds + 3, print_fd);
+    #undef print_fd
+
+    return 0;
+}
+
+typedef struct _ref_obj {
+    int         refs;
+    const char* name;
+} ref_obj_t;
+
+static void ref_obj_destroy(ref_obj_t* o) {
+    printf("defer_unref: destroy [%s]\n", o->name);
+}
+
+int test_defer_unref() {
+
+    ref_obj_t a = { 1, "obj-a" };
+    ref_obj_t b = { 1, "obj-b" };
+    {
+        defer_init(512, NULL);
+
+        int i;
+        for (i = 0; i < 3; i ++) {
+            __atomic_add_fetch(&a.refs, 1, __ATOMIC_RELAXED);
+            defer_unref(&a, refs, ref_obj_destroy);
+        }
+        __atomic_add_fetch(&b.refs, 1, __ATOMIC_RELAXED);
+        defer_unref(&b, refs, ref_obj_destroy);
+
+        // last ref of `a` is dropped in this scope
+        defer_unref(&a, refs, ref_obj_destroy);
+
+        defer({
+            printf("defer_unref: a.refs=%d b.refs=%d\n", a.refs, b.refs);
+        });
+    }
+    printf("defer_unref: a.refs=%d b.refs=%d\n", a.refs, b.refs);
+
+    return 0;
+}
+
+#if DEFER_OUTLIVE_OK
+
+static char* make_named_buf(defer_closure_mgr_t* owner, const char* name, int fail) {
+    defer_init(256, NULL);
+
+    defer_mark_t m = defer_mark();
+
+    char* buf = (char*)malloc(100);
+    defer1(buf, {
+        printf("defer_transfer: free [%s]\n", buf);
+        free(buf);
+    });
+    const char* tag = name;
+    defer1(tag, printf("defer_transfer: cleanup of [%s]\n", tag));
+
+    snprintf(buf, 100, "%s", name);
+    if (fail) {
+        printf("defer_transfer: make [%s] failed\n", name);
+        return NULL;
+    }
+
+    if (!defer_transfer(m, owner)) {
+        return NULL;
+    }
+    printf("defer_transfer: make [%s] ok\n", name);
+    return buf;
+}
+
+static void* heap_closure_alloc(defer_closure_allocator_t* self, int size) {
+    (void)self;
+    return malloc(size);
+}
+
+static void heap_closure_release(defer_closure_allocator_t* self, void* obj) {
+    (void)self;
+    free(obj);
+}
+
+static defer_closure_allocator_t heap_allocator = { heap_closure_alloc, heap_closure_release };
+
+static char* make_heap_buf(defer_closure_mgr_t* owner) {
+    // builtin buffer is too small, closures come from heap allocator
+    defer_init(16, &heap_allocator);
+
+    defer_mark_t m = defer_mark();
+    char* buf = strdup("buf-3");
+    defer1(buf, {
+        printf("defer_transfer: free heap closure [%s]\n", buf);
+        free(buf);
+    });
+
+    // moved by re-linking only
+    if (!defer_transfer(m, owner)) {
+        return NULL;
+    }
+    return buf;
+}
+
+/// one ref of @o is dropped here, the one taken after the mark is handed to @owner
+static void unref_after_mark(defer_closure_mgr_t* owner, ref_obj_t* o) {
+    defer_init(256, NULL);
+
+    defer_unref(o, refs, ref_obj_destroy);
+    defer_mark_t m = defer_mark();
+    defer_unref(o, refs, ref_obj_destroy);
+
+    defer_transfer(m, owner);
+}
+
+/// scratch memory of `defer_alloc` after the mark stays here, only the closure is copied
+static int scratch_after_mark(defer_closure_mgr_t* owner) {
+    defer_init(1024, NULL);
+
+    defer_mark_t m = defer_mark();
+    char* tmp = (char*)defer_alloc(512, 16);
+    snprintf(tmp, 512, "scratch");
+    const char* tag = "after scratch";
+    defer1(tag, printf("defer_transfer: cleanup of [%s]\n", tag));
+
+    return defer_transfer(m, owner);
+}
+
+/// a mark taken after another one is stale once the older one is transferred
+static void stale_mark(defer_closure_mgr_t* owner) {
+    defer_init(256, NULL);
+
+    defer_mark_t m1 = defer_mark();
+    const char* tag1 = "mark-1";
+    defer1(tag1, printf("defer_transfer: cleanup of [%s]\n", tag1));
+    defer_mark_t m2 = defer_mark();
+    const char* tag2 = "mark-2";
+    defer1(tag2, printf("defer_transfer: cleanup of [%s]\n", tag2));
+
+    int ok1 = defer_transfer(m1, owner);
+    int ok2 = defer_transfer(m2, owner);
+    printf("defer_transfer: older mark=%d expect=1, stale mark=%d expect=0\n", ok1, ok2);
+}
+
+int test_defer_transfer() {
+
+    {
+        defer_init(256, NULL);
+
+        defer(printf("defer_transfer: caller exit\n"));
+
+        char* b1 = make_named_buf(defer_mgr(), "buf-1", 0);
+        char* b2 = make_named_buf(defer_mgr(), "buf-2", 1);
+        printf("defer_transfer: b1=[%s] b2=%p\n", b1, (void*)b2);
+    }
+
+    {
+        defer_init(32, &heap_allocator);
+
+        char* b3 = make_heap_buf(defer_mgr());
+        printf("defer_transfer: b3=[%s]\n", b3);
+    }
+
+    {
+        // builtin buffer of owner is full, relocated closures come from its allocator
+        defer_init(32, &heap_allocator);
+
+        char* b4 = make_named_buf(defer_mgr(), "buf-4", 0);
+        printf("defer_transfer: b4=[%s]\n", b4);
+    }
+
+    {
+        defer_init(256, NULL);
+
+        int ok = scratch_after_mark(defer_mgr());
+        printf("defer_transfer: closure after defer_alloc(512)=%d expect=1\n", ok);
+        stale_mark(defer_mgr());
+    }
+
+    ref_obj_t o = { 3, "obj-t" };
+    {
+        defer_init(256, NULL);
+
+        unref_after_mark(defer_mgr(), &o);
+        printf("defer_transfer: unref after mark, refs=%d expect=2\n", o.refs);
+    }
+    printf("defer_transfer: owner exit, refs=%d expect=1\n", o.refs);
+
+    return 0;
+}
+
+#else
+
+int test_defer_transfer() {
+    printf("defer_transfer: not available at -O0\n");
+    return 0;
+}
+
+#endif
+
+int test_hot_cold() {
+
+    defer_init(256, NULL);
+
+    defer_byref int calls = 0;
+    defer_hot({
+        printf("defer_hot: called, calls=%d\n", calls);
+    });
+    calls ++;
+
+    {
+        scope_exit_hot({
+            printf("scope_exit_hot: called\n");
+        });
+        scope_exit({
+            printf("scope_exit: cold body called\n");
+        });
+    }
+
+    return 0;
+}
+
+/// with blocks (clang) outer vars are captured by value, unless declared `defer_byref`
+int test_defer_capture() {
+
+    defer_init(128, NULL);
+
+    defer_byref int by_ref = 1;
+    int by_value = 1;
+    defer({
+        printf("defer capture: by_ref=%d expect=2, by_value=%d expect=%d\n",
+            by_ref, by_value, DEFER_BYREF_CAPTURE ? 2 : 1);
+    });
+    {
+        scope_exit({
+            printf("scope_exit capture: by_ref=%d expect=3, by_value=%d expect=%d\n",
+                by_ref, by_value, DEFER_BYREF_CAPTURE ? 3 : 1);
+        });
+        by_ref = 3;
+        by_value = 3;
+    }
+    by_ref = 2;
+    by_value = 2;
+
+    return 0;
+}
+
+static void add_range(long* out, int lo, int hi) {
+    long sum = 0;
+    int i;
+    for (i = lo; i < hi; i ++) {
+        sum += i;
+    }
+    __atomic_add_fetch(out, sum, __ATOMIC_RELAXED);
+}
+
+static void spawn_nested(scope_pool_t* pool, long* out, int base) {
+    // nested block inside a task
+    scope_tasks(pool) {
+        scope_spawn(add_range, out, base, base + 100);
+        scope_spawn(add_range, out, base + 100, base + 200);
+    }
+}
+
+static long sum_with_early_return(scope_pool_t* pool, int stop_at) {
+    long sum = 0;
+    int i;
+    scope_tasks(pool) {
+        for (i = 0; i < 10; i ++) {
+            if (i == stop_at) {
+                return -1; // spawned tasks are joined before returning
+            }
+            scope_spawn(add_range, &sum, i * 10, i * 10 + 10);
+        }
+    }
+    return sum;
+}
+
+int test_scope_tasks() {
+
+    scope_pool_t* pool = scope_pool_create(4);
+
+    long sum = 0;
+    scope_tasks(pool) {
+        int i;
+        for (i = 0; i < 100; i ++) {
+            scope_spawn(add_range, &sum, i * 100, i * 100 + 100);
+        }
+    }
+    printf("scope_tasks: sum=%ld expect=%ld\n", sum, 9999L * 10000 / 2);
+
+    long sum2 = 0;
+    scope_tasks(pool) {
+        int i;
+        for (i = 0; i < 10; i ++) {
+            scope_spawn(spawn_nested, pool, &sum2, i * 200);
+        }
+        scope_spawn_code({
+            printf("scope_tasks: spawn code block\n");
+        });
+    }
+    printf("scope_tasks: nested sum=%ld expect=%ld\n", sum2, 1999L * 2000 / 2);
+
+    printf("scope_tasks: early return=%ld, full=%ld\n",
+        sum_with_early_return(pool, 5), sum_with_early_return(pool, -1));
+
+    scope_pool_destroy(pool);
+    return 0;
+}
+
+#if DEFER_OUTLIVE_OK
+
+static int g_mem_only_calls = 0;
+
+static void* registry_thread_main(void* arg) {
+    const char* name = (const char*)arg;
+    defer_thread1(name, printf("defer_thread: [%s] exits\n", name));
+    char* buf = strdup("thread-local cache");
+    defer_thread_mem1(buf, {
+        printf("defer_thread: free [%s]\n", buf);
+        free(buf);
+    });
+    return NULL;
+}
+
+/// called by a process closure at exit, the registry is not locked then
+static void register_at_exit(void) {
+    defer_process(printf("defer_process: closure registered at exit\n"));
+}
+
+int test_defer_registry() {
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, registry_thread_main, (void*)"worker-1");
+    pthread_join(tid, NULL);
+
+    // called at process exit, after the memory-only closures below
+    defer_process({
+        printf("defer_process: memory-only closures called: %d\n", g_mem_only_calls);
+    });
+
+    int fd = 1;
+    defer_process1(fd, printf("defer_process: flush and close fd %d\n", fd));
+
+    char* cache = strdup("process-wide cache");
+    defer_process_mem1(cache, {
+        g_mem_only_calls ++;
+        free(cache);
+    });
+    cache = NULL;
+
+    defer_thread(printf("defer_thread: main thread registry at exit\n"));
+
+    defer_process(register_at_exit());
+
+    // skip memory-only closures at exit
+    defer_set_fast_exit(1);
+
+    return 0;
+}
+
+#else
+
+int test_defer_registry() {
+    printf("defer_process/defer_thread: not available at -O0\n");
+    return 0;
+}
+
+#endif
+
+int test_scope_mmap() {
+
+    char path[] = "/tmp/c_defer_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    scope_exit1(fd, close(fd));
+    const char* tmp_path = path; // blocks cannot capture arrays
+    scope_exit1(tmp_path, {
+        unlink(tmp_path);
+    });
+
+    const char* text = "hello scope_mmap_file";
+    if (write(fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+        return -1;
+    }
+
+    {
+        scope_mmap_view_t view;
+        scope_mmap_rw(path, &view);
+        printf("scope_mmap_rw: error=%d size=%d\n", view.error, (int)view.size);
+        memcpy(view.data, "HELLO", 5);
+    }
+
+    {
+        scope_mmap_view_t view;
+        scope_mmap_file_ex(path, &view, SCOPE_MMAP_POPULATE | SCOPE_MMAP_SEQUENTIAL);
+        printf("scope_mmap_file: error=%d [%.*s]\n", view.error, (int)view.size, (const char*)view.data);
+
+        scope_mmap_view_t missing;
+        scope_mmap_file("/tmp/c_defer_no_such_file", &missing);
+        printf("scope_mmap_file: missing file error=%d data=%p\n", missing.error, missing.data);
+    }
+
+    return 0;
+}
+
+static pthread_mutex_t  g_count_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t g_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static long g_count = 0;
+static long g_table = 0;
+
+static void* lock_thread_main(void* arg) {
+    int i;
+    long seen = 0;
+    (void)arg;
+    for (i = 0; i < 10000; i ++) {
+        {
+            scope_lock(&g_count_lock);
+            g_count ++;
+        }
+        if (i % 10 == 0) {
+            scope_wrlock(&g_table_lock);
+            g_table ++;
+        } else {
+            scope_rdlock(&g_table_lock);
+            seen += g_table;
+        }
+    }
+    return (void*)seen;
+}
+
+int test_scope_lock() {
+
+    pthread_t tids[4];
+    int i;
+    for (i = 0; i < 4; i ++) {
+        pthread_create(&tids[i], NULL, lock_thread_main, NULL);
+    }
+    for (i = 0; i < 4; i ++) {
+        pthread_join(tids[i], NULL);
+    }
+    printf("scope_lock: count=%ld table=%ld\n", g_count, g_table);
+
+    scope_lock_profile_dump(stdout);
+
+    return 0;
+}
+
 
 int main() {
 
@@ -366,5 +891,25 @@ int main() {
 
     test_defer();
 
+    test_defer_alloc();
+
+    test_defer_each();
+
+    test_defer_unref();
+
+    test_defer_transfer();
+
+    test_hot_cold();
+
+    test_defer_capture();
+
+    test_scope_tasks();
+
+    test_scope_mmap();
+
+    test_scope_lock();
+
+    test_defer_registry();
+
     return 0;
 }
\ No newline at end of file
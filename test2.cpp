@@ -0,0 +1,192 @@
+/**
+ * c_defer and c_scope_guard
+ * test for C++ version: c_defer.hpp
+ * by: cloudsong @ 2024
+ * License: MIT
+ */
+
+#include "c_defer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+// -----------------------------------------------------------------------------
+
+extern "C" {
+    char* c_make_buf(defer_closure_mgr_t* owner, const char* name);
+    void  c_frame_with_cpp_closures(const char* name);
+
+    void cpp_register_cleanup(defer_closure_mgr_t* mgr, const char* name) {
+        std::string s = std::string("c++ closure in c frame: ") + name;
+        c_defer::push(mgr, [s = std::move(s)]() noexcept {
+            printf("%s\n", s.c_str());
+        });
+    }
+}
+
+struct ref_obj {
+    int         refs;
+    const char* name;
+};
+
+static void ref_obj_destroy(ref_obj* o) {
+    printf("defer_unref: destroy [%s]\n", o->name);
+}
+
+int test_defer() {
+
+    defer_init(1024, nullptr);
+
+    defer({
+        printf("0: defer is called!\n");
+    });
+
+    const char* s = "123123";
+    defer1_ex(s, {
+        printf("1: call defer! s=%s\n", defer_arg(0));
+    });
+    s = nullptr;
+
+    int zz = 100;
+    defer1(zz, {
+        printf("2: zz = %d\n", zz);
+    });
+    zz = 1023;
+
+    char* mem1 = (char*)malloc(100);
+    strcpy(mem1, "3: defer2_named");
+    int id = 3;
+    defer2_named(my_mem, mem1, my_id, id, {
+        printf("%d: free [%s]\n", my_id, my_mem);
+        free(my_mem);
+    });
+    mem1 = nullptr;
+
+    // move-only capture
+    std::unique_ptr<std::string> up(new std::string("4: unique_ptr moved into closure"));
+    defer_move1(up, {
+        printf("%s\n", up->c_str());
+    });
+
+    char* bufs[3];
+    for (int i = 0; i < 3; i ++) {
+        bufs[i] = (char*)malloc(16);
+    }
+    defer_each(bufs, 3, free);
+
+    ref_obj o = { 2, "obj" };
+    defer_unref(&o, refs, ref_obj_destroy);
+    defer_unref(&o, refs, ref_obj_destroy);
+
+    char* tmp = (char*)defer_alloc(64, 16);
+    snprintf(tmp, 64, "5: defer_alloc");
+    defer({
+        printf("%s\n", tmp);
+    });
+
+    return 0;
+}
+
+/// tells if it is still alive when a closure uses it
+struct loud {
+    const char* name;
+    bool        alive = true;
+    explicit loud(const char* n) noexcept: name(n) {}
+    loud(const loud& o) noexcept: name(o.name) {}
+    ~loud() {
+        alive = false;
+        printf("lifetime: ~loud [%s]\n", name);
+    }
+};
+
+int test_lifetime() {
+    // by-ref: declared before defer_init, destroyed after the closures
+    loud before("before");
+    defer_init(256, nullptr);
+    defer(printf("lifetime: [%s] alive=%d expect=1\n", before.name, (int)before.alive));
+
+    // declared after defer_init: destroyed first, the closure keeps a copy
+    loud after("after");
+    defer1(after, printf("lifetime: copy of [%s] alive=%d expect=1\n", after.name, (int)after.alive));
+    return 0;
+}
+
+int test_scope_exit() {
+
+    scope_exit({
+        printf("scope_exit: exit\n");
+    });
+
+    int a = 1;
+    const char* b = "b";
+    scope_exit2(a, b, {
+        printf("scope_exit2: a=%d b=%s\n", a, b);
+    });
+    a = 2;
+
+    scope_exit1_ex(a + 100, {
+        printf("scope_exit1_ex: %d\n", scope_arg(0));
+    });
+    return 0;
+}
+
+int test_shared_mgr() {
+    {
+        defer_init(256, nullptr);
+
+        defer({
+            printf("c++ frame exit\n");
+        });
+        char* buf = c_make_buf(defer_mgr(), "from c");
+        printf("c++ frame: got [%s]\n", buf);
+    }
+
+    c_frame_with_cpp_closures("c-frame");
+    return 0;
+}
+
+/// @return result of `defer_transfer`, closure with a std::string can't be relocated
+static bool make_named(defer_closure_mgr_t* owner, bool with_string) {
+    defer_init(256, nullptr);
+
+    defer_mark_t m = defer_mark();
+    if (with_string) {
+        std::string name("string capture");
+        defer_move1(name, {
+            printf("defer_transfer: cleanup of [%s]\n", name.c_str());
+        });
+    } else {
+        const char* name = "pointer capture";
+        defer1(name, {
+            printf("defer_transfer: cleanup of [%s]\n", name);
+        });
+    }
+    return defer_transfer(m, owner);
+}
+
+int test_transfer() {
+    defer_init(256, nullptr);
+
+    bool ok1 = make_named(defer_mgr(), false);
+    bool ok2 = make_named(defer_mgr(), true);
+    printf("defer_transfer: pointer=%d expect=1, string=%d expect=0\n", ok1, ok2);
+    return 0;
+}
+
+int main() {
+
+    test_defer();
+
+    test_lifetime();
+
+    test_scope_exit();
+
+    test_shared_mgr();
+
+    test_transfer();
+
+    return 0;
+}
@@ -0,0 +1,44 @@
+/**
+ * c_defer and c_scope_guard
+ * C part of test2.cpp: C and C++ frames share one closure manager
+ * by: cloudsong @ 2024
+ * License: MIT
+ */
+
+#include "c_defer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// -----------------------------------------------------------------------------
+
+/// defined in test2.cpp, register C++ closures into @mgr
+void cpp_register_cleanup(defer_closure_mgr_t* mgr, const char* name);
+
+/// register C closures, then hand them to the C++ caller's manager
+char* c_make_buf(defer_closure_mgr_t* owner, const char* name) {
+    defer_init(256, NULL);
+
+    defer_mark_t m = defer_mark();
+
+    char* buf = strdup(name);
+    defer1(buf, {
+        printf("c closure: free [%s]\n", buf);
+        free(buf);
+    });
+
+    defer_transfer(m, owner);
+    return buf;
+}
+
+/// C frame whose manager gets C++ closures
+void c_frame_with_cpp_closures(const char* name) {
+    defer_init(256, NULL);
+
+    defer1(name, printf("c closure: [%s] exit\n", name));
+
+    cpp_register_cleanup(defer_mgr(), name);
+
+    printf("c frame: [%s] body\n", name);
+}
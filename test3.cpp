@@ -0,0 +1,148 @@
+/**
+ * c_defer and c_scope_guard
+ * test for defer scopes in C++20 coroutine frames
+ * by: cloudsong @ 2024
+ * License: MIT
+ */
+
+#define ENABLE_DEFER_COROUTINE
+
+#include "c_defer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+// -----------------------------------------------------------------------------
+
+/// @brief minimal lazy task, frame is destroyed by owner
+struct task {
+    struct promise_type: c_defer::coro_defer<512> {
+        task get_return_object() noexcept {
+            return task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+        std::suspend_never  initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::abort(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+
+    ~task() {
+        if (h) {
+            h.destroy();
+        }
+    }
+};
+
+/// resumed by test code, like an I/O completion
+static std::coroutine_handle<> g_waiting;
+
+struct wait_io {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { g_waiting = h; }
+    void await_resume() const noexcept {}
+};
+
+/// a plain function registers cleanup into the coroutine's manager
+static char* open_buf(defer_closure_mgr_t* owner, const char* name) {
+    char* buf = strdup(name);
+    c_defer::push(owner, [buf]() noexcept {
+        printf("co_defer: helper frees [%s]\n", buf);
+        free(buf);
+    });
+    return buf;
+}
+
+static task echo_op(const char* name) {
+    co_defer_init();
+
+    defer1(name, printf("co_defer: [%s] frame destroyed\n", name));
+
+    std::unique_ptr<std::string> msg(new std::string(std::string(name) + ": pending message"));
+    defer_move1(msg, printf("co_defer: drop [%s]\n", msg->c_str()));
+
+    char* buf = open_buf(defer_mgr(), name);
+    char* tmp = (char*)defer_alloc(64, 0);
+    snprintf(tmp, 64, "%s: scratch", name);
+
+    printf("co_defer: [%s] suspend\n", name);
+    co_await wait_io{};
+    printf("co_defer: [%s] resumed, buf=[%s] tmp=[%s]\n", name, buf, tmp);
+}
+
+int test_co_defer_complete() {
+    void* frame;
+    {
+        task t = echo_op("op-1");
+        frame = t.h.address();
+        g_waiting.resume();
+        printf("co_defer: op-1 done=%d\n", (int)t.h.done());
+    }
+    {
+        // frame comes from per-thread cache
+        task t = echo_op("op-2");
+        printf("co_defer: frame reused=%d\n", (int)(t.h.address() == frame));
+        g_waiting.resume();
+    }
+    return 0;
+}
+
+/// frame is much bigger than the one of `echo_op`: the buffer lives across the suspension
+static task big_op(const char* name) {
+    co_defer_init();
+
+    defer1(name, printf("co_defer: [%s] frame destroyed\n", name));
+
+    char big[8192];
+    snprintf(big, sizeof(big), "%s: big frame", name);
+    co_await wait_io{};
+    printf("co_defer: [%s] resumed, big=[%s]\n", name, big);
+}
+
+int test_co_defer_frame_sizes() {
+    void* small_frame;
+    void* big_frame;
+    {
+        task s = echo_op("small-1");
+        small_frame = s.h.address();
+        g_waiting.resume();
+    }
+    {
+        task b = big_op("big-1");
+        big_frame = b.h.address();
+        g_waiting.resume();
+    }
+    {
+        // frames of different sizes interleave, each one reuses a cached frame of its size
+        task s = echo_op("small-2");
+        g_waiting.resume();
+        task b = big_op("big-2");
+        g_waiting.resume();
+        printf("co_defer: small reused=%d big reused=%d\n",
+            (int)(s.h.address() == small_frame), (int)(b.h.address() == big_frame));
+    }
+    return 0;
+}
+
+int test_co_defer_cancel() {
+    task t = echo_op("op-cancel");
+    printf("co_defer: cancel while suspended\n");
+    t.h.destroy();
+    t.h = nullptr;
+    return 0;
+}
+
+int main() {
+
+    test_co_defer_complete();
+
+    test_co_defer_cancel();
+
+    test_co_defer_frame_sizes();
+
+    return 0;
+}